@@ -0,0 +1,142 @@
+/*
+Copyright 2023, The DyTIS Authors.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "src/DyTIS.h"
+
+// Latency histogram with HDR-style log-linear buckets: values below
+// 2^kSubBits ns are exact, larger ones fall in one of 2^kSubBits buckets per
+// power of two, i.e. within 1/2^kSubBits of their value.
+class LatencyHistogram {
+  static const int kSubBits = 5;
+  static const uint64_t kSub = (uint64_t)1 << kSubBits;
+
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t max_ns = 0;
+  double sum_ns = 0;
+
+  static size_t bucket(uint64_t ns) {
+    if (ns < kSub)
+      return ns;
+    int shift = 63 - __builtin_clzll(ns) - kSubBits;
+    return ((size_t)(shift + 1) << kSubBits) + ((ns >> shift) - kSub);
+  }
+
+  // largest value of bucket b
+  static uint64_t upper(size_t b) {
+    if (b < kSub)
+      return b;
+    int shift = (int)(b >> kSubBits) - 1;
+    return (((b & (kSub - 1)) + kSub + 1) << shift) - 1;
+  }
+
+ public:
+  LatencyHistogram(void) : counts((64 - kSubBits + 1) << kSubBits, 0) {}
+
+  static uint64_t now(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void record(uint64_t ns) {
+    counts[bucket(ns)]++;
+    total++;
+    max_ns = std::max(max_ns, ns);
+    sum_ns += ns;
+  }
+
+  void merge(const LatencyHistogram& other) {
+    for (size_t b = 0; b < counts.size(); b++)
+      counts[b] += other.counts[b];
+    total += other.total;
+    max_ns = std::max(max_ns, other.max_ns);
+    sum_ns += other.sum_ns;
+  }
+
+  // smallest bucket bound with at least p of the samples at or below it
+  uint64_t percentile(double p) const {
+    uint64_t rank = (uint64_t)(p * total + 0.5);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < counts.size(); b++) {
+      seen += counts[b];
+      if (seen >= rank && seen > 0)
+        return std::min(upper(b), max_ns);
+    }
+    return max_ns;
+  }
+
+  void print(const std::string& name) const {
+    if (total == 0)
+      return;
+    std::cout << "\t" << name << " latency (" << total << " samples):\t"
+              << "avg " << (uint64_t)(sum_ns / total) << " ns,\t"
+              << "p50 " << percentile(0.5) << " ns,\t"
+              << "p99 " << percentile(0.99) << " ns,\t"
+              << "p99.9 " << percentile(0.999) << " ns,\t"
+              << "max " << max_ns << " ns" << std::endl;
+  }
+};
+
+// samples every n-th operation of one thread into its histogram, n == 0
+// samples none
+class LatencySampler {
+  uint64_t every;
+  uint64_t left;
+
+ public:
+  LatencyHistogram histogram;
+
+  LatencySampler(uint64_t n) : every(n), left(n) {}
+
+  template <typename F>
+  void run(F&& op) {
+    if (every == 0 || --left != 0) {
+      op();
+      return;
+    }
+    left = every;
+    uint64_t start = LatencyHistogram::now();
+    op();
+    histogram.record(LatencyHistogram::now() - start);
+  }
+};
+
+inline void print_smo_stats(const SMOStats& stats) {
+  auto line = [](const char* name, const SMOCount& c) {
+    std::cout << "\t" << name << ":\t" << c.count << " runs,\t"
+              << c.ns / 1e9 << " sec";
+    if (c.count > 0)
+      std::cout << ",\t" << c.ns / c.count << " ns/run";
+    std::cout << std::endl;
+  };
+  std::cout << "structural modifications" << std::endl;
+  line("split", stats.split);
+  line("doubling", stats.doubling);
+  line("expand", stats.expand);
+  line("expand (failed)", stats.expand_failed);
+  line("local remap", stats.remap);
+  line("local remap (failed)", stats.remap_failed);
+  line("divide ranges", stats.divide);
+}
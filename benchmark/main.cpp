@@ -38,12 +38,15 @@ limitations under the License.
 
 #include "flags.h"
 #include "utils.h"
+#include "histogram.h"
 
 #include "src/DyTIS.h"
 #include "src/DyTIS_impl.h"
+#include "src/ShardedDyTIS_impl.h"
 
 #define KEY_TYPE uint64_t
 #define PAYLOAD_TYPE uint64_t
+typedef DyTIS<KEY_TYPE, PAYLOAD_TYPE> Index;
 
 using namespace std;
 
@@ -60,6 +63,14 @@ using namespace std;
  * --lookup_distribution    lookup keys distribution (options: uniform or zipf)
  * --time_limit             time limit, in minutes
  * --print_batch_stats      whether to output stats for each batch
+ * --num_threads            number of insert/lookup threads (-DCONCURRENT)
+ * --front_end_threads      route inserts to this many ShardedDyTIS workers
+ *                          (0: insert directly)
+ * --latency_sample         time every n-th insert, lookup and scan of each
+ *                          thread (0: none), inserts through the front end
+ *                          are not timed
+ * --maintenance            restructure full segments on a background thread
+ *                          (-DCONCURRENT)
  */
 int main(int argc, char* argv[]) {
   auto flags = parse_flags(argc, argv);
@@ -73,6 +84,11 @@ int main(int argc, char* argv[]) {
   auto time_limit = stod(get_with_default(flags, "time_limit", "1.0"));
   bool print_batch_stats = get_boolean_flag(flags, "print_batch_stats");
   auto range_size = stoi(get_required(flags, "range_size"));
+#ifdef CONCURRENT
+  auto num_threads = stoi(get_with_default(flags, "num_threads", "1"));
+#endif
+  auto front_end_threads = stoi(get_with_default(flags, "front_end_threads", "0"));
+  auto latency_sample = stoull(get_with_default(flags, "latency_sample", "0"));
 
   const size_t kInitialTableSize = 16*1024;
 
@@ -91,7 +107,11 @@ int main(int argc, char* argv[]) {
   std::cout << "Finish reading keys from file" << std::endl;
 
   std::mt19937_64 gen_payload(std::random_device{}());
-  DyTIS* index = new DyTIS();
+  Index* index = new Index();
+#ifdef CONCURRENT
+  if (get_boolean_flag(flags, "maintenance"))
+    index->StartMaintenance();
+#endif
 
   // Run workload
   int i = 0;
@@ -109,6 +129,11 @@ int main(int argc, char* argv[]) {
   std::cout << "num_inserts_per_batch: " << num_inserts_per_batch << std::endl;
   std::cout << "num_lookups_per_batch: " << num_lookups_per_batch << std::endl;
   std::cout << "num_scans_per_batch: " << num_scans_per_batch << std::endl;
+#if defined(SEP) && defined(SIMD_SEARCH)
+  std::cout << "bucket search: simd" << std::endl;
+#else
+  std::cout << "bucket search: exponential" << std::endl;
+#endif
 
   int batch_no = 0;
   std::cout << std::scientific;
@@ -127,10 +152,47 @@ int main(int argc, char* argv[]) {
 
   // Do inserts
   std::cout << "insert start!" << std::endl;
+  LatencyHistogram insert_latency;
   auto inserts_start_time = std::chrono::high_resolution_clock::now();
-  for (; i < num_keys_after_batch; i++) {
-    index->Insert(keys[i], static_cast<PAYLOAD_TYPE>(gen_payload()));
+  if (front_end_threads > 0) {
+    ShardedDyTIS<KEY_TYPE, PAYLOAD_TYPE> front_end(*index, front_end_threads);
+    for (; i < num_keys_after_batch; i++)
+      front_end.Insert(keys[i], static_cast<PAYLOAD_TYPE>(gen_payload()));
+    front_end.Flush();
   }
+#ifdef CONCURRENT
+  else {
+    std::vector<std::thread> threads;
+    std::vector<LatencySampler> samplers(num_threads, LatencySampler(latency_sample));
+    // gen_payload is not thread-safe, each thread draws from its own
+    std::vector<std::mt19937_64> payloads;
+    for (int t = 0; t < num_threads; t++)
+      payloads.emplace_back(gen_payload());
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&, t] {
+        for (int j = i + t; j < num_keys_after_batch; j += num_threads)
+          samplers[t].run([&] {
+            index->Insert(keys[j], static_cast<PAYLOAD_TYPE>(payloads[t]()));
+          });
+      });
+    }
+    for (auto& t : threads)
+      t.join();
+    for (auto& sampler : samplers)
+      insert_latency.merge(sampler.histogram);
+    i = num_keys_after_batch;
+  }
+#else
+  else {
+    LatencySampler sampler(latency_sample);
+    for (; i < num_keys_after_batch; i++) {
+      sampler.run([&] {
+        index->Insert(keys[i], static_cast<PAYLOAD_TYPE>(gen_payload()));
+      });
+    }
+    insert_latency.merge(sampler.histogram);
+  }
+#endif
   auto inserts_end_time = std::chrono::high_resolution_clock::now();
   double batch_insert_time =
       std::chrono::duration_cast<std::chrono::nanoseconds>(inserts_end_time -
@@ -147,6 +209,8 @@ int main(int argc, char* argv[]) {
             << " inserts/sec,\t"
             << "\n----------------------------------------------------------"
             << std::endl;
+  insert_latency.print("insert");
+  print_smo_stats(index->GetSMOStats());
 
   // Do lookups
   KEY_TYPE* lookup_keys = nullptr;
@@ -161,11 +225,35 @@ int main(int argc, char* argv[]) {
   }
 
   std::cout << "lookup start!" << std::endl;
+  LatencyHistogram lookup_histogram;
   auto lookups_start_time = std::chrono::high_resolution_clock::now();
-  for (int j = 0; j < num_lookups_per_batch; j++) {
-    KEY_TYPE key = lookup_keys[j];
-    Value_t ret = index->Get(key);
+#ifdef CONCURRENT
+  {
+    std::vector<std::thread> threads;
+    std::vector<LatencySampler> samplers(num_threads, LatencySampler(latency_sample));
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&, t] {
+        for (int j = t; j < num_lookups_per_batch; j += num_threads) {
+          KEY_TYPE key = lookup_keys[j];
+          samplers[t].run([&] { Value_t ret = index->Get(key); });
+        }
+      });
+    }
+    for (auto& t : threads)
+      t.join();
+    for (auto& sampler : samplers)
+      lookup_histogram.merge(sampler.histogram);
+  }
+#else
+  {
+    LatencySampler sampler(latency_sample);
+    for (int j = 0; j < num_lookups_per_batch; j++) {
+      KEY_TYPE key = lookup_keys[j];
+      sampler.run([&] { Value_t ret = index->Get(key); });
+    }
+    lookup_histogram.merge(sampler.histogram);
   }
+#endif
   auto lookups_end_time = std::chrono::high_resolution_clock::now();
   double batch_lookup_time =
       std::chrono::duration_cast<std::chrono::nanoseconds>(lookups_end_time -
@@ -176,6 +264,10 @@ int main(int argc, char* argv[]) {
   delete[] lookup_keys;
   cumulative_lookup_time += batch_lookup_time;
   cumulative_lookups += num_lookups_per_batch;
+  double lookup_latency = cumulative_lookup_time / cumulative_lookups;
+#ifdef CONCURRENT
+  lookup_latency *= num_threads; // each thread did 1/num_threads of lookups
+#endif
   std::cout << "lookup finish!" << std::endl;
   std::cout << "Cumulative stats: " << batch_no << " batches, "
             << cumulative_lookups << " lookups"
@@ -183,11 +275,16 @@ int main(int argc, char* argv[]) {
             << "\n\tcumulative lookup throughput:\t"
             << cumulative_lookups / cumulative_lookup_time * 1e9
             << " lookups/sec,\t"
+            << "\n\taverage lookup latency:\t"
+            << lookup_latency << " ns/lookup"
             << "\n----------------------------------------------------------"
             << std::endl;
+  lookup_histogram.print("lookup");
 
   // Do scans
   std::cout << "scan start!" << std::endl;
+  auto scan_result = new Index::Pair[range_size];
+  LatencySampler scan_sampler(latency_sample);
 
   auto time_scan_start = std::chrono::high_resolution_clock::now();
   while (1) {
@@ -197,8 +294,7 @@ int main(int argc, char* argv[]) {
     auto scan_start_time = std::chrono::high_resolution_clock::now();
     for (int j = 0; j < num_scans_per_batch; j++) {
       KEY_TYPE key = scan_start_keys[j];
-      auto payload = index->Scan(key, range_size);
-      delete[] payload;
+      scan_sampler.run([&] { index->Scan(key, range_size, scan_result); });
     }
 
     auto scan_end_time = std::chrono::high_resolution_clock::now();
@@ -255,5 +351,7 @@ int main(int argc, char* argv[]) {
             << "overall: "
             << cumulative_time / 1e9 << " sec"
             << std::endl;
+  scan_sampler.histogram.print("scan");
+  delete[] scan_result;
   delete[] keys;
 }
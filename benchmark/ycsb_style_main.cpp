@@ -35,11 +35,13 @@ limitations under the License.
 
 #include "flags.h"
 #include "utils.h"
+#include "histogram.h"
 
 #include "src/DyTIS.h"
 #include "src/DyTIS_impl.h"
 #define KEY_TYPE uint64_t
 #define PAYLOAD_TYPE uint64_t
+typedef DyTIS<KEY_TYPE, PAYLOAD_TYPE> Index;
 
 using namespace std;
 
@@ -55,6 +57,11 @@ using namespace std;
  * --lookup_distribution    lookup keys distribution (options: uniform or zipf)
  * --time_limit             time limit, in minutes
  * --print_batch_stats      whether to output stats for each batch
+ * --load_threads           load init_num_keys with ParallelInsert on this
+ *                          many threads (0: sort and BulkLoad)
+ * --latency_sample         time every n-th operation of each kind (0: none)
+ * --maintenance            restructure full segments on a background thread
+ *                          (-DCONCURRENT)
  */
 int main(int argc, char* argv[]) {
   auto flags = parse_flags(argc, argv);
@@ -68,6 +75,8 @@ int main(int argc, char* argv[]) {
   auto time_limit = stod(get_with_default(flags, "time_limit", "1.0"));
   bool print_batch_stats = get_boolean_flag(flags, "print_batch_stats");
   auto range_size = stoi(get_required(flags, "range_size"));
+  auto load_threads = stoi(get_with_default(flags, "load_threads", "0"));
+  auto latency_sample = stoull(get_with_default(flags, "latency_sample", "0"));
   bool read_modify_write = false; // true iff workload F
   const size_t kInitialTableSize = 16*1024;
 
@@ -89,13 +98,39 @@ int main(int argc, char* argv[]) {
 
   std::mt19937_64 gen_payload(std::random_device{}());
   std::cout << "DTS version" << std::endl;
-  DyTIS* index = new DyTIS();
+  Index* index = new Index();
+  auto values = new Index::Pair[init_num_keys];
   for (int load_num = 0; load_num < init_num_keys; load_num++) {
-    index->Insert(keys[load_num], static_cast<PAYLOAD_TYPE>(gen_payload()));
+    values[load_num].key = keys[load_num];
+    values[load_num].value = static_cast<PAYLOAD_TYPE>(gen_payload());
   }
+  if (load_threads == 0)
+    std::stable_sort(values, values + init_num_keys,
+                     [](const Index::Pair& a, const Index::Pair& b) { return a.key < b.key; });
+  auto bulk_load_start_time = std::chrono::high_resolution_clock::now();
+  if (load_threads > 0)
+    index->ParallelInsert(values, init_num_keys, load_threads);
+  else
+    index->BulkLoad(values, init_num_keys);
+  auto bulk_load_end_time = std::chrono::high_resolution_clock::now();
+  std::cout << (load_threads > 0 ? "parallel insert time: " : "bulk load time: ")
+            << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   bulk_load_end_time - bulk_load_start_time).count() / 1e9
+            << " sec" << std::endl;
+  delete[] values;
+#ifdef CONCURRENT
+  if (get_boolean_flag(flags, "maintenance"))
+    index->StartMaintenance();
+#endif
+  SMOStats load_smo = index->GetSMOStats();
 
 
   // Run workload
+  auto scan_result = new Index::Pair[range_size];
+  LatencySampler insert_sampler(latency_sample);
+  LatencySampler update_sampler(latency_sample);
+  LatencySampler lookup_sampler(latency_sample);
+  LatencySampler scan_sampler(latency_sample);
   int i = init_num_keys;
   long long cumulative_inserts = 0;
   long long cumulative_updates = 0;
@@ -211,7 +246,7 @@ int main(int argc, char* argv[]) {
       }
       auto lookups_start_time = std::chrono::high_resolution_clock::now();
       for (int j = 0; j < num_lookups_per_batch; j++) {
-        index->Get(lookup_keys[j]);
+        lookup_sampler.run([&] { index->Get(lookup_keys[j]); });
       }
       auto lookups_end_time = std::chrono::high_resolution_clock::now();
       batch_lookup_time =
@@ -239,8 +274,7 @@ int main(int argc, char* argv[]) {
       auto scan_start_time = std::chrono::high_resolution_clock::now();
       for (int j = 0; j < num_scans_per_batch; j++) {
         KEY_TYPE key = scan_start_keys[j];
-        auto payload = index->Scan(key, range_size);
-        delete[] payload;
+        scan_sampler.run([&] { index->Scan(key, range_size, scan_result); });
       }
 
       auto scan_end_time = std::chrono::high_resolution_clock::now();
@@ -272,13 +306,15 @@ int main(int argc, char* argv[]) {
       }
       auto updates_start_time = std::chrono::high_resolution_clock::now();
       for (int j = 0; j < num_updates_per_batch; j++) {
-        if (!read_modify_write) {// update
-          index->Update(update_keys[j], static_cast<PAYLOAD_TYPE>(gen_payload()));
-        }
-        else { // if Workload F, try to search the key first and do update
-          index->Get(update_keys[j]);
-          index->Update(update_keys[j], static_cast<PAYLOAD_TYPE>(gen_payload()));
-        }
+        update_sampler.run([&] {
+          if (!read_modify_write) {// update
+            index->Update(update_keys[j], static_cast<PAYLOAD_TYPE>(gen_payload()));
+          }
+          else { // if Workload F, try to search the key first and do update
+            index->Get(update_keys[j]);
+            index->Update(update_keys[j], static_cast<PAYLOAD_TYPE>(gen_payload()));
+          }
+        });
       }
       auto updates_end_time = std::chrono::high_resolution_clock::now();
       delete[] update_keys;
@@ -299,7 +335,9 @@ int main(int argc, char* argv[]) {
 
       auto inserts_start_time = std::chrono::high_resolution_clock::now();
       for (; i < num_keys_after_batch; i++) {
-        index->Insert(keys[i], static_cast<PAYLOAD_TYPE>(gen_payload()));
+        insert_sampler.run([&] {
+          index->Insert(keys[i], static_cast<PAYLOAD_TYPE>(gen_payload()));
+        });
       }
       auto inserts_end_time = std::chrono::high_resolution_clock::now();
       double batch_insert_time =
@@ -384,7 +422,21 @@ int main(int argc, char* argv[]) {
             << "overall: "
             << cumulative_time / 1e9 << " sec"
             << std::endl;
+  update_sampler.histogram.print("update");
+  insert_sampler.histogram.print("insert");
+  lookup_sampler.histogram.print("lookup");
+  scan_sampler.histogram.print("scan");
+  // of the workload, not of the load phase
+  SMOStats smo = index->GetSMOStats();
+  const SMOCount* from = &load_smo.split;
+  SMOCount* to = &smo.split;
+  for (size_t k = 0; k < sizeof(SMOStats) / sizeof(SMOCount); k++) {
+    to[k].count -= from[k].count;
+    to[k].ns -= from[k].ns;
+  }
+  print_smo_stats(smo);
 
+  delete[] scan_result;
   delete[] keys;
 
 }
@@ -16,218 +16,199 @@ limitations under the License.
 
 #pragma once
 #include <stdio.h>
-#include <boost/pool/pool_alloc.hpp>
+#include <cassert>
+#include <vector>
+#include <type_traits>
+#include <sys/mman.h>
+#ifdef SIMD_SEARCH
+#include <immintrin.h>
+#endif
+#include <mutex>
+#include <chrono>
+#include "util/arena.h"
+#ifdef CONCURRENT
+#include "util/lock.h"
+#include "util/epoch.h"
+#include "util/mpsc.h"
+#endif
 #define DO_NOTHING
 #define INITIAL_RANGE_BITS 1
 #define RANGE_BITS_LIMIT 17
-typedef struct Directory Directory;
-
+// local cdf of a segment, one entry per range. keys of range i map linearly
+// onto [end of range i-1 (0 for the first), end), in units of
+// 2^(key bits below the segment) per bucket. integer and continuous, so the
+// mapping is a multiply-shift and moving buckets between ranges is exact.
 struct LineFriends {
-  double gradient;
-  double y_intercept;
+  uint64_t end;
 };
-boost::pool_allocator<Directory> seg_alloc;
 
-#ifdef SEP
-boost::pool_allocator<Pair> pair_alloc;
-boost::pool<> chunk_alloc[20] = {
-  boost::pool<>(sizeof(Pair)*kNumSlot),
-  boost::pool<>(sizeof(Pair)*kNumSlot*2),
-  boost::pool<>(sizeof(Pair)*kNumSlot*3),
-  boost::pool<>(sizeof(Pair)*kNumSlot*4),
-  boost::pool<>(sizeof(Pair)*kNumSlot*5),
-  boost::pool<>(sizeof(Pair)*kNumSlot*6),
-  boost::pool<>(sizeof(Pair)*kNumSlot*7),
-  boost::pool<>(sizeof(Pair)*kNumSlot*8),
-  boost::pool<>(sizeof(Pair)*kNumSlot*9),
-  boost::pool<>(sizeof(Pair)*kNumSlot*10),
-  boost::pool<>(sizeof(Pair)*kNumSlot*11),
-  boost::pool<>(sizeof(Pair)*kNumSlot*12),
-  boost::pool<>(sizeof(Pair)*kNumSlot*13),
-  boost::pool<>(sizeof(Pair)*kNumSlot*14),
-  boost::pool<>(sizeof(Pair)*kNumSlot*15),
-  boost::pool<>(sizeof(Pair)*kNumSlot*16),
-  boost::pool<>(sizeof(Pair)*kNumSlot*17),
-  boost::pool<>(sizeof(Pair)*kNumSlot*18),
-  boost::pool<>(sizeof(Pair)*kNumSlot*19),
-  boost::pool<>(sizeof(Pair)*kNumSlot*20)
+#ifdef CONCURRENT
+// pairs a full segment took while DyTIS::StartMaintenance is on, sorted by
+// key. they wait there until the maintenance thread restructures the segment
+// and moves them into its slots. a key is never in both.
+template <typename K, typename V>
+struct Overflow {
+  uint32_t num = 0;
+  KVPair<K, V> pairs[OVERFLOW_SIZE];
 };
-#else
-boost::pool_allocator<Pair> pair_alloc;
-boost::pool<> chunk_alloc[20] = {
-  boost::pool<>(sizeof(Pair)*kNumSlot),
-  boost::pool<>(sizeof(Pair)*kNumSlot*2),
-  boost::pool<>(sizeof(Pair)*kNumSlot*3),
-  boost::pool<>(sizeof(Pair)*kNumSlot*4),
-  boost::pool<>(sizeof(Pair)*kNumSlot*5),
-  boost::pool<>(sizeof(Pair)*kNumSlot*6),
-  boost::pool<>(sizeof(Pair)*kNumSlot*7),
-  boost::pool<>(sizeof(Pair)*kNumSlot*8),
-  boost::pool<>(sizeof(Pair)*kNumSlot*9),
-  boost::pool<>(sizeof(Pair)*kNumSlot*10),
-  boost::pool<>(sizeof(Pair)*kNumSlot*11),
-  boost::pool<>(sizeof(Pair)*kNumSlot*12),
-  boost::pool<>(sizeof(Pair)*kNumSlot*13),
-  boost::pool<>(sizeof(Pair)*kNumSlot*14),
-  boost::pool<>(sizeof(Pair)*kNumSlot*15),
-  boost::pool<>(sizeof(Pair)*kNumSlot*16),
-  boost::pool<>(sizeof(Pair)*kNumSlot*17),
-  boost::pool<>(sizeof(Pair)*kNumSlot*18),
-  boost::pool<>(sizeof(Pair)*kNumSlot*19),
-  boost::pool<>(sizeof(Pair)*kNumSlot*20)
+#endif
+
+#ifdef INSERT_BUFFER
+// kept per bucket after the slots. keys inserted out of order are appended
+// after the sorted run; count is only maintained while buffered > 0.
+struct BucketMeta {
+  uint8_t buffered; // # of unsorted keys at the end of the occupied slots
+  uint8_t count; // # of occupied slots
 };
+const size_t kBucMeta = sizeof(BucketMeta);
+#else
+const size_t kBucMeta = 0;
 #endif
-int pool_num = 20;
-boost::pool<> line_alloc[10] = {
-  boost::pool<>(sizeof(double)*2*2), // 2 ranges
-  boost::pool<>(sizeof(double)*4*2), // 4 ranges
-  boost::pool<>(sizeof(double)*8*2),
-  boost::pool<>(sizeof(double)*16*2),
-  boost::pool<>(sizeof(double)*32*2),
-  boost::pool<>(sizeof(double)*64*2),
-  boost::pool<>(sizeof(double)*128*2),
-  boost::pool<>(sizeof(double)*256*2),
-  boost::pool<>(sizeof(double)*512*2),
-  boost::pool<>(sizeof(double)*1024*2)
+
+// runs of one kind of structural modification and the time spent in them
+struct SMOCount {
+  uint64_t count = 0;
+  uint64_t ns = 0;
 };
-int line_pool_num = 10;
 
+// structural modifications run by writers (or the maintenance thread) on a
+// full bucket, see DyTIS::GetSMOStats
+struct SMOStats {
+  SMOCount split;         // segment split, directory updated in place
+  SMOCount doubling;      // segment split that doubled the directory
+  SMOCount expand;        // buckets added to a segment without local cdf
+  SMOCount expand_failed; // at the bucket limit, the segment is split next
+  SMOCount remap;         // local cdf tuned and keys remapped in place
+  SMOCount remap_failed;  // no bucket could be reclaimed for the range
+  SMOCount divide;        // divide_ranges_if_needed before a remap
+};
+
+const size_t pool_num = 20; // slot arrays of up to pool_num buckets are pooled
+const int line_pool_num = 10; // local cdf of up to 2^line_pool_num ranges
+
+template <typename K, typename V, size_t kNumSlot> struct IndexContext;
 
+// K: unsigned fixed-width key, V: trivially copyable payload (empty slots
+// hold value_traits<V>::invalid()), kNumSlot: # of slots per bucket
+template <typename K, typename V, size_t kNumSlot>
 struct Directory {
-  Directory(void) {
-    seg_num = 1;
+  typedef K Key_t;
+  typedef V Value_t;
+  typedef KeyItem<K> Key;
+  typedef ValueItem<V> Value;
+  typedef KVPair<K, V> Pair;
+  typedef IndexContext<K, V, kNumSlot> Context;
+#ifdef CONCURRENT
+  typedef Overflow<K, V> Overflow_t;
+#endif
+  static_assert(std::is_unsigned<K>::value && sizeof(K) >= 4 && sizeof(K) <= 8,
+                "key must be an unsigned 32-bit or 64-bit integer");
+  static_assert(std::is_trivially_copyable<V>::value,
+                "value is moved with memmove");
+  static_assert(kNumSlot > 0 && kNumSlot <= UINT16_MAX, "block is uint16_t");
+#ifdef INSERT_BUFFER
+  static_assert(kNumSlot <= UINT8_MAX, "BucketMeta::count is uint8_t");
+#endif
+
+  static constexpr Key_t INVALID = static_cast<Key_t>(-1);
+  static constexpr Value_t NONE = Value_t();
+  static constexpr uint16_t block = kNumSlot;
+  static constexpr int kKeyBits = 8*sizeof(Key_t);
+  static constexpr uint64_t y_mask = ((uint64_t)1 << (kKeyBits - kDepth)) - 1;
 #ifdef SEP
-    if (seg_num <= pool_num) {
-      void* addr = chunk_alloc[seg_num-1].malloc();
-      key_slot = new(static_cast<Key*>(addr)) \
-             Key[seg_num*kNumSlot];
-      void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
-      val_slot = new(static_cast<Value*>(val_addr))\
-                 Value[seg_num*kNumSlot];
-    }
-    else {
-      void* addr = malloc(sizeof(Key)*seg_num*kNumSlot*2);
-      key_slot = new(static_cast<Key*>(addr)) \
-             Key[seg_num*kNumSlot];
-      void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
-      val_slot = new(static_cast<Value*>(val_addr))\
-                 Value[seg_num*kNumSlot];
-    }
+  static constexpr size_t kSlotBytes = sizeof(Key) + sizeof(Value);
 #else
-    if (seg_num <= pool_num) {
-      slot = new(static_cast<Pair*>(chunk_alloc[seg_num-1].malloc())) \
-             Pair[seg_num*kNumSlot];
-    }
-    else
-      slot = new Pair[seg_num*kNumSlot];
+  static constexpr size_t kSlotBytes = sizeof(Pair);
 #endif
-    remap_available = 1;
-    // for local cdf
-    line = NULL;
-    range_bits = 0;
-    sibling = NULL;
+
+  // bytes of the slot array of n buckets, meta is padded to a cache line
+  static constexpr size_t chunk_size(size_t n) {
+    return kSlotBytes*kNumSlot*n + ((n*kBucMeta + 63) & ~(size_t)63);
   }
 
-  Directory(size_t ld) {
-    seg_num = 1;
+  // slot arrays come from ctx, segments are freed by ctx.free_segment
+  Directory(size_t ld, int _num, Context& ctx) {
+    seg_num = _num;
 #ifdef SEP
-    if (seg_num <= pool_num) {
-      void* addr = chunk_alloc[seg_num-1].malloc();
-      key_slot = new(static_cast<Key*>(addr)) \
-             Key[seg_num*kNumSlot];
-      void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
-      val_slot = new(static_cast<Value*>(val_addr))\
-                 Value[seg_num*kNumSlot];
-    }
-    else {
-      void* addr = malloc(sizeof(Key)*seg_num*kNumSlot*2);
-      key_slot = new(static_cast<Key*>(addr)) \
-             Key[seg_num*kNumSlot];
-      void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
-      val_slot = new(static_cast<Value*>(val_addr))\
-                 Value[seg_num*kNumSlot];
-    }
+    void* addr = ctx.chunk_malloc(seg_num);
+    key_slot = new(static_cast<Key*>(addr)) \
+           Key[seg_num*kNumSlot];
+    void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
+    val_slot = new(static_cast<Value*>(val_addr))\
+               Value[seg_num*kNumSlot];
 #else
-    if (seg_num <= pool_num) {
-      slot = new(static_cast<Pair*>(chunk_alloc[seg_num-1].malloc())) \
-             Pair[seg_num*kNumSlot];
-    }
-    else
-      slot = new Pair[seg_num*kNumSlot];
+    slot = new(static_cast<Pair*>(ctx.chunk_malloc(seg_num))) \
+           Pair[seg_num*kNumSlot];
 #endif
-    remap_available = 1;
+    remap_available = seg_num;
     // for local cdf
     line = NULL;
     range_bits = 0;
     sibling = NULL;
   }
 
-  Directory(size_t ld, int _num) {
+  // slots already filled in chunk, e.g. in a mapped snapshot
+  Directory(void* chunk, int _num) {
     seg_num = _num;
 #ifdef SEP
-    if (seg_num <= pool_num) {
-      void* addr = chunk_alloc[seg_num-1].malloc();
-      key_slot = new(static_cast<Key*>(addr)) \
-             Key[seg_num*kNumSlot];
-      void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
-      val_slot = new(static_cast<Value*>(val_addr))\
-                 Value[seg_num*kNumSlot];
-    }
-    else {
-      void* addr = malloc(sizeof(Key)*seg_num*kNumSlot*2);
-      key_slot = new(static_cast<Key*>(addr)) \
-             Key[seg_num*kNumSlot];
-      void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
-      val_slot = new(static_cast<Value*>(val_addr))\
-                 Value[seg_num*kNumSlot];
-    }
+    key_slot = static_cast<Key*>(chunk);
+    val_slot = (Value*)((char*)chunk + sizeof(Key) * seg_num * kNumSlot);
 #else
-    if (seg_num <= pool_num) {
-      slot = new(static_cast<Pair*>(chunk_alloc[seg_num-1].malloc())) \
-             Pair[seg_num*kNumSlot];
-    }
-    else
-      slot = new Pair[seg_num*kNumSlot];
+    slot = static_cast<Pair*>(chunk);
 #endif
     remap_available = seg_num;
-    // for local cdf
     line = NULL;
     range_bits = 0;
     sibling = NULL;
   }
-  ~Directory(void) {
-#ifdef SEP
-    if (seg_num <= pool_num) {
-      chunk_alloc[seg_num-1].free(key_slot);
-    }
-    else {
-      free(key_slot);
-    }
-#else
-    if (seg_num <= pool_num)
-      chunk_alloc[seg_num-1].free(slot);
-    else
-      delete[] slot;
-#endif
-    if (line != NULL) {
-      if (range_bits <= 10)
-        line_alloc[range_bits-1].free(line);
-      else
-        delete[] line;
-    }
-  }
 
   inline int Insert(Key_t&, Value_t, size_t, size_t);
   inline int Delete(Key_t&, size_t, size_t, bool, int);
-  inline Directory* LocalRemap(size_t, int);
-  inline Directory** Split(size_t, int);
+  inline Directory* LocalRemap(size_t, int, int, Context&);
+  inline Directory** Split(size_t, int, Context&);
   inline int find_lower(Key_t&, size_t);
-  inline int exponential_search(Key_t&, size_t);
+  inline int exponential_search(Key_t&, size_t, int n = kNumSlot);
   inline int binary_search_upper_bound(int, int, Key_t, size_t);
+#ifdef SIMD_SEARCH
+  inline int simd_upper_bound(int, int, Key_t, size_t);
+#endif
   inline Value_t Get(Key_t&, size_t);
-  inline void Scan(Key_t&, int&, size_t, size_t, Value_t*);
+  inline void prefetch_bucket(size_t);
+  inline size_t scan_position(Key_t&, int);
+  template <typename F> inline bool Scan(size_t&, F&&);
   inline Value_t* Find(Key_t&, size_t);
-  inline bool Expand(int, int);
+  inline bool Expand(int, int, int, Context&);
+  static inline Directory* BulkLoad(const Pair*, size_t, int, bool,
+                                    std::vector<Pair>&, Context&);
+  static constexpr uint64_t kImageAlign = 64; // of slots and lines in a snapshot
+  // segment in a snapshot. slots and local cdf are kept as is in the data
+  // section, at offsets from its start.
+  struct Image {
+    uint64_t seg_num;
+    double remap_available;
+    int32_t reclaim_flag;
+    int32_t range_bits;
+    uint64_t num_key;
+    uint32_t local_depth;
+    uint32_t has_line;
+    uint64_t chunk_offset;
+    uint64_t line_offset;
+  };
+  inline Image image(size_t, uint64_t&);
+  inline bool save_data(const Image&, FILE*, uint64_t&);
+  static inline bool valid(const Image&, uint64_t);
+  static inline Directory* Load(const Image&, FILE*, uint64_t&, Context&);
+  static inline Directory* Map(const Image&, char*, Context&);
+#ifdef INSERT_BUFFER
+  inline int bucket_size(size_t);
+  inline void buffered_range(size_t, int&, int&);
+  inline int sort_buffer(size_t, int, int, Key_t*, Value_t*);
+  inline int sorted_bucket(size_t, Key_t*, Value_t*);
+  inline int find_buffered(Key_t&, size_t);
+  inline int buffered_upper_bound(Key_t, size_t);
+  inline void merge_buffer(size_t);
+  inline void flush_buffers(void);
+#endif
 #ifdef SEP
   Key* key_slot;
   Value* val_slot;
@@ -245,28 +226,369 @@ struct Directory {
   Directory* sibling = NULL;
   uint64_t num_key = 0; // the number of keys stored
   LineFriends* line = NULL;
+#ifdef CONCURRENT
+  Overflow_t* overflow = NULL; // allocated by the first parked pair
+  VersionLock lock;
+  // hidden local depth of EH assumes sizeof(Directory) == 1 << DIRECTORY_BITS
+  char padding[(1 << DIRECTORY_BITS) - 10*sizeof(uint64_t)];
+#endif
+
+#ifdef SEP
+  inline Key_t& key_at(size_t i) { return key_slot[i].item; }
+  inline Value_t& value_at(size_t i) { return val_slot[i].item; }
+#else
+  inline Key_t& key_at(size_t i) { return slot[i].key; }
+  inline Value_t& value_at(size_t i) { return slot[i].value; }
+#endif
+#ifdef INSERT_BUFFER
+  inline BucketMeta* bucket_meta(void) {
+    return (BucketMeta*)((char*)&key_at(0) + kSlotBytes*seg_num*kNumSlot);
+  }
+#endif
 
   size_t data_size(void) {
     size_t size = sizeof(Directory);
-    size += sizeof(Pair) * seg_num*kNumSlot;
-    int ranges = (1 << range_bits);
-    size += sizeof(double) * ranges; // line
+    size += chunk_size(seg_num);
+    if (line != NULL)
+      size += sizeof(LineFriends) << range_bits;
+#ifdef CONCURRENT
+    if (overflow != NULL)
+      size += sizeof(Overflow_t);
+#endif
     return size;
   }
 
+#ifdef CONCURRENT
+  // index of key in the overflow, -1 if it is not parked
+  inline int overflow_find(Key_t key) {
+    if (overflow == NULL || overflow->num == 0)
+      return -1;
+    // bounded, an optimistic reader may see num of a concurrent writer
+    int n = std::min<uint32_t>(overflow->num, OVERFLOW_SIZE);
+    Pair* p = std::lower_bound(overflow->pairs, overflow->pairs + n, key,
+        [](const Pair& a, Key_t k) { return a.key < k; });
+    return (p != overflow->pairs + n && p->key == key) ? p - overflow->pairs : -1;
+  }
+  inline bool overflow_insert(Key_t, Value_t);
+  inline void overflow_erase(int);
+#endif
+
   // for local cdf
-  inline void split_local_cdf(Directory** split, int local_depth);
+  inline void split_local_cdf(Directory** split, int local_depth, Context& ctx);
   inline int get_local_cdf_range (size_t key, int local_depth);
   inline int get_bucket_increase (int range, int local_depth);
-  // reclaim gradient as much as bucket delta and give it to the range
+  // reclaim buckets as much as needed_bucket and give them to the range
   inline bool tuning_local_cdf (int range, int& needed_bucket, \
       std::vector<int>& range_count, int local_depth);
-  inline int tuning_local_cdf_by_range(int needed_bucket, int range, int local_depth);
+  inline int tuning_local_cdf_by_range(int needed_bucket, int range, int local_depth,
+                                       int max_bits);
   inline size_t lcdf(int local_depth, size_t key);
-  inline int divide_ranges_if_needed (uint64_t, int);
-  inline void init_lcdf (int local_depth);
+  inline uint64_t range_start(int range) {
+    return range == 0 ? 0 : line[range-1].end;
+  }
+  // move the ends of range and the ranges after it by delta
+  inline void shift_ranges(int range, int64_t delta) {
+    for (int i = range; i < (1 << range_bits); i++)
+      line[i].end += delta;
+  }
+  inline int divide_ranges_if_needed (uint64_t, int, Context&);
+  inline void init_lcdf (int local_depth, Context& ctx);
   inline double get_segment_util();
+  // buckets the segment may have under max_bits of its EH. one that grew
+  // past them before the EH went back to SKEWED_MAX_BITS keeps the limit of
+  // UNIFORM_MAX_BITS, splitting it instead would copy its buckets to both
+  // halves
+  inline uint64_t max_seg_num(int local_depth, int max_bits) {
+    uint64_t max = Context::max_bucket_num(local_depth, max_bits);
+    return seg_num > max ? Context::max_bucket_num(local_depth, UNIFORM_MAX_BITS)
+                         : max;
+  }
   inline int find_over_range(int z, int local_depth, Key_t* over_bucket);
   inline int find_over_range(int z, int local_depth);
 };
 
+// memory pools and skew decision of one DyTIS, shared by all of its segments.
+// indexes never share a context, so each adapts on its own and releases its
+// pools when destroyed.
+template <typename K, typename V, size_t kNumSlot>
+struct IndexContext {
+  typedef Directory<K, V, kNumSlot> Directory_t;
+
+  // slabs from ArenaAllocator, chunks of a multiple of ARENA_ALIGN bytes stay
+  // aligned
+  typedef SlabPool Pool;
+  Pool seg_alloc{sizeof(Directory_t)};
+  Pool chunk_alloc[pool_num] = {
+    Pool(Directory_t::chunk_size(1)),
+    Pool(Directory_t::chunk_size(2)),
+    Pool(Directory_t::chunk_size(3)),
+    Pool(Directory_t::chunk_size(4)),
+    Pool(Directory_t::chunk_size(5)),
+    Pool(Directory_t::chunk_size(6)),
+    Pool(Directory_t::chunk_size(7)),
+    Pool(Directory_t::chunk_size(8)),
+    Pool(Directory_t::chunk_size(9)),
+    Pool(Directory_t::chunk_size(10)),
+    Pool(Directory_t::chunk_size(11)),
+    Pool(Directory_t::chunk_size(12)),
+    Pool(Directory_t::chunk_size(13)),
+    Pool(Directory_t::chunk_size(14)),
+    Pool(Directory_t::chunk_size(15)),
+    Pool(Directory_t::chunk_size(16)),
+    Pool(Directory_t::chunk_size(17)),
+    Pool(Directory_t::chunk_size(18)),
+    Pool(Directory_t::chunk_size(19)),
+    Pool(Directory_t::chunk_size(20))
+  };
+  Pool line_alloc[line_pool_num] = {
+    Pool(sizeof(LineFriends)*2), // 2 ranges
+    Pool(sizeof(LineFriends)*4), // 4 ranges
+    Pool(sizeof(LineFriends)*8),
+    Pool(sizeof(LineFriends)*16),
+    Pool(sizeof(LineFriends)*32),
+    Pool(sizeof(LineFriends)*64),
+    Pool(sizeof(LineFriends)*128),
+    Pool(sizeof(LineFriends)*256),
+    Pool(sizeof(LineFriends)*512),
+    Pool(sizeof(LineFriends)*1024)
+  };
+  // SlabPool is not thread-safe, locked in the concurrent mode and while
+  // several threads write disjoint EHs (parallel, ShardedDyTIS)
+  std::mutex pool_mutex;
+  bool parallel = false;
+#ifdef CONCURRENT
+  // first and last key of segments whose pairs were parked, consumed by the
+  // maintenance thread. NULL unless DyTIS::StartMaintenance is on
+  MPSCQueue<std::pair<K, K>>* deferred = NULL;
+#endif
+  // snapshot mapped by DyTIS::MapSnapshot, its slots and lines are never
+  // returned to the pools
+  char* mapped = NULL;
+  size_t mapped_size = 0;
+  bool unmap = true; // false if the mapping belongs to another context
+  // If workload is skewed, max_bits is SKEWED_MAX_BITS
+  // Else if workload is uniform, max_bits is UNIFORM_MAX_BITS
+  // set once by DyTIS::uniform_test, EH x follows it until part_bits[x] is
+  // decided from its own full segments (sample_full)
+  int max_bits = SKEWED_MAX_BITS;
+  int8_t part_bits[1 << kDepth] = {}; // 0: not decided yet
+  // full segments of EH x since its last decision << 32 | those filled to
+  // BUC_THRE
+  uint64_t samples[1 << kDepth] = {};
+  SMOStats smo; // updated atomically, read by smo_stats
+  uint64_t reclaims = 0; // remaps that took buckets from other ranges
+
+  IndexContext(void) {}
+  IndexContext(const IndexContext&) = delete;
+  IndexContext& operator=(const IndexContext&) = delete;
+  ~IndexContext(void) {
+    if (mapped != NULL && unmap)
+      munmap(mapped, mapped_size);
+  }
+
+  inline std::unique_lock<std::mutex> lock_pools(void) {
+#ifdef CONCURRENT
+    return std::unique_lock<std::mutex>(pool_mutex);
+#else
+    if (parallel)
+      return std::unique_lock<std::mutex>(pool_mutex);
+    return std::unique_lock<std::mutex>();
+#endif
+  }
+
+  inline bool is_mapped(const void* addr) {
+    return (const char*)addr >= mapped && (const char*)addr < mapped + mapped_size;
+  }
+
+  // cached slab memory of the pools back to the os, return its bytes
+  inline size_t release_memory(void) {
+    auto guard = lock_pools();
+    size_t released = seg_alloc.release();
+    for (size_t i = 0; i < pool_num; i++)
+      released += chunk_alloc[i].release();
+    for (int i = 0; i < line_pool_num; i++)
+      released += line_alloc[i].release();
+    return released;
+  }
+
+  // add the usage of the segment, slot and line pools to usage, in this order
+  inline void pool_usage(std::vector<PoolUsage>& usage) {
+    auto guard = lock_pools();
+    std::vector<PoolUsage> mine;
+    mine.push_back(seg_alloc.usage());
+    for (size_t i = 0; i < pool_num; i++)
+      mine.push_back(chunk_alloc[i].usage());
+    for (int i = 0; i < line_pool_num; i++)
+      mine.push_back(line_alloc[i].usage());
+    if (usage.empty()) {
+      usage = mine;
+      return;
+    }
+    for (size_t i = 0; i < mine.size(); i++) {
+      usage[i].live_bytes += mine[i].live_bytes;
+      usage[i].cached_bytes += mine[i].cached_bytes;
+    }
+  }
+
+  static inline uint64_t smo_clock(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // one run of an SMO started at smo_clock() == start
+  inline void count_smo(SMOCount& c, uint64_t start) {
+    __atomic_fetch_add(&c.count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c.ns, smo_clock() - start, __ATOMIC_RELAXED);
+  }
+
+  // add the SMOs of this index to stats
+  inline void smo_stats(SMOStats& stats) {
+    const SMOCount* from = &smo.split;
+    SMOCount* to = &stats.split;
+    for (size_t i = 0; i < sizeof(SMOStats) / sizeof(SMOCount); i++) {
+      to[i].count += __atomic_load_n(&from[i].count, __ATOMIC_RELAXED);
+      to[i].ns += __atomic_load_n(&from[i].ns, __ATOMIC_RELAXED);
+    }
+  }
+
+  static inline uint64_t max_bucket_num(size_t local_depth, int bits) {
+    // [TODO] : return 1, not 2..
+    if (local_depth >= REMAP_THRE)
+      return ((uint64_t)1 << (bits+local_depth-REMAP_THRE));
+    else
+      return 1;
+  }
+
+  // max_bits of EH x
+  inline int bits_of(size_t x) {
+    int bits = __atomic_load_n(&part_bits[x], __ATOMIC_RELAXED);
+    return bits != 0 ? bits : __atomic_load_n(&max_bits, __ATOMIC_RELAXED);
+  }
+
+  // a full segment of local depth REMAP_THRE or more in EH x, uniform if its
+  // buckets were filled to BUC_THRE. every SKEW_SAMPLE of them decide the
+  // max_bits of x again, with a gap between UNIFORM_EXIT and UNIFORM_ENTER so
+  // an EH near the threshold does not flip on every decision
+  inline void sample_full(size_t x, bool uniform) {
+    uint64_t add = ((uint64_t)1 << 32) | uniform;
+    uint64_t taken = __atomic_fetch_add(&samples[x], add, __ATOMIC_RELAXED) + add;
+    if ((taken >> 32) != SKEW_SAMPLE)
+      return;
+    __atomic_fetch_sub(&samples[x], taken, __ATOMIC_RELAXED);
+    double share = (double)(uint32_t)taken / SKEW_SAMPLE;
+    int bits = bits_of(x);
+    if (share >= UNIFORM_ENTER)
+      bits = UNIFORM_MAX_BITS;
+    else if (share <= UNIFORM_EXIT)
+      bits = SKEWED_MAX_BITS;
+    __atomic_store_n(&part_bits[x], (int8_t)bits, __ATOMIC_RELAXED);
+  }
+
+  // slot array for seg_num buckets (keys and values under SEP)
+  inline void* chunk_malloc(size_t seg_num) {
+    void* addr;
+    if (seg_num <= pool_num) {
+      auto guard = lock_pools();
+      addr = chunk_alloc[seg_num-1].malloc();
+    }
+    else
+      addr = ArenaAllocator::malloc(Directory_t::chunk_size(seg_num));
+#ifdef INSERT_BUFFER
+    memset((char*)addr + Directory_t::kSlotBytes*seg_num*kNumSlot, 0,
+           seg_num*kBucMeta);
+#endif
+    return addr;
+  }
+
+  inline void chunk_free(void* addr, size_t seg_num) {
+    if (is_mapped(addr))
+      return;
+    if (seg_num <= pool_num) {
+      auto guard = lock_pools();
+      chunk_alloc[seg_num-1].free(addr);
+    }
+    else
+      ArenaAllocator::free((char*)addr);
+  }
+
+  // piecewise linear model of (1 << range_bits) ranges
+  inline LineFriends* line_malloc(int range_bits) {
+    if (range_bits <= line_pool_num) {
+      auto guard = lock_pools();
+      return static_cast<LineFriends*>(line_alloc[range_bits-1].malloc());
+    }
+    return (LineFriends*)ArenaAllocator::malloc(sizeof(LineFriends) << range_bits);
+  }
+
+  inline void line_free(LineFriends* line, int range_bits) {
+    if (is_mapped(line))
+      return;
+    if (range_bits <= line_pool_num) {
+      auto guard = lock_pools();
+      line_alloc[range_bits-1].free(line);
+    }
+    else
+      ArenaAllocator::free((char*)line);
+  }
+
+  inline void* seg_malloc(void) {
+    auto guard = lock_pools();
+    return seg_alloc.malloc();
+  }
+
+  inline Directory_t* new_segment(size_t ld, int num = 1) {
+    return new(seg_malloc()) Directory_t(ld, num, *this);
+  }
+
+  // segment over num buckets of filled slots in chunk
+  inline Directory_t* adopt_segment(void* chunk, int num) {
+    return new(seg_malloc()) Directory_t(chunk, num);
+  }
+
+  // segment with its slots and local cdf
+  inline void free_segment(Directory_t* seg) {
+#ifdef SEP
+    chunk_free(seg->key_slot, seg->seg_num);
+#else
+    chunk_free(seg->slot, seg->seg_num);
+#endif
+    if (seg->line != NULL)
+      line_free(seg->line, seg->range_bits);
+#ifdef CONCURRENT
+    delete seg->overflow;
+#endif
+    auto guard = lock_pools();
+    seg_alloc.free(seg);
+  }
+
+  // replaced in a live index, concurrent readers may still hold them
+  inline void retire_chunk(void* addr, size_t seg_num) {
+#ifdef CONCURRENT
+    epoch::retire(this, addr, [](void* ctx, void* p, size_t n) {
+      static_cast<IndexContext*>(ctx)->chunk_free(p, n);
+    }, seg_num);
+#else
+    chunk_free(addr, seg_num);
+#endif
+  }
+
+  inline void retire_line(LineFriends* line, int range_bits) {
+#ifdef CONCURRENT
+    epoch::retire(this, line, [](void* ctx, void* p, size_t rb) {
+      static_cast<IndexContext*>(ctx)->line_free(static_cast<LineFriends*>(p), rb);
+    }, range_bits);
+#else
+    line_free(line, range_bits);
+#endif
+  }
+
+  inline void retire_segment(Directory_t* seg) {
+#ifdef CONCURRENT
+    epoch::retire(this, seg, [](void* ctx, void* p, size_t) {
+      static_cast<IndexContext*>(ctx)->free_segment(static_cast<Directory_t*>(p));
+    }, 0);
+#else
+    free_segment(seg);
+#endif
+  }
+};
@@ -17,7 +17,9 @@ limitations under the License.
 #pragma once
 #include "src/Directory.h"
 
-inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
+template <typename K, typename V, size_t kNumSlot>
+inline Directory<K, V, kNumSlot>* Directory<K, V, kNumSlot>::LocalRemap(size_t key, int local_depth,
+    int max_bits, Context& ctx) {
   if (remap_available == -1) {
     return NULL;
   }
@@ -28,38 +30,35 @@ inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
     remap_available = 0;
     fixed = false;
   }
-  static std::vector<double> old_line;
-  for (int i = 0; i < ranges; i++) {
-    old_line.push_back(line[i].gradient);
-    old_line.push_back(line[i].y_intercept);
-  }
+  std::vector<LineFriends> old_line(line, line + ranges);
   int available = remap_available;
   auto local_key_hash = lcdf(local_depth, key);
-  auto z = (local_key_hash >> (64 - kDepth - local_depth));
+  auto z = (local_key_hash >> (kKeyBits - kDepth - local_depth));
   int snum = seg_num;
-  size_t local_mask = ((size_t)1 << (8*sizeof(Key_t)-kDepth-local_depth))-1;
+  size_t local_mask = ((size_t)1 << (kKeyBits-kDepth-local_depth))-1;
   uint64_t over_key = key & local_mask; // may be key is already masked
   uint64_t first_over_key = over_key;
   auto seg = kNumSlot;
   int over_range;
   int over_buc = z;
   uint64_t one_bucket = (
-      (uint64_t)1 << (64 - kDepth - local_depth));
+      (uint64_t)1 << (kKeyBits - kDepth - local_depth));
   int buc_idx = 0;
   int buc_num = 0;
-  static std::vector<int> range_count;
+  std::vector<int> range_count;
+  int reclaimed = 0; // tunings that took buckets, undone if the remap fails
   if (fixed)
     range_count.assign(reclaim_flag, block+1);
 
   int buffer = 0;
 
-  uint64_t limit_stride = ((size_t)1 << (64 - kDepth -local_depth));
+  uint64_t limit_stride = ((size_t)1 << (kKeyBits - kDepth -local_depth));
   uint64_t  one_range = limit_stride / ranges;
   over_range = find_over_range(z, local_depth);
   if (fixed == true) { // it means this local remap includes reclaim process
     uint64_t first_key = lcdf(local_depth, (reclaim_flag*one_range));
     int iter_range = reclaim_flag; // start range
-    int iter_bucket = (first_key >> (64 - kDepth -local_depth));
+    int iter_bucket = (first_key >> (kKeyBits - kDepth -local_depth));
     int iter_index = 0;
     int range_num = 0;
     while (iter_bucket < seg_num) {
@@ -113,39 +112,33 @@ inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
       first_over_key = min_over_range;
       uint64_t tlocal_key_hash = lcdf(local_depth, first_over_key);
       auto temp_z = (tlocal_key_hash >> \
-          (64 - kDepth - local_depth));
+          (kKeyBits - kDepth - local_depth));
       over_buc = temp_z;
       int needed_bucket = get_bucket_increase(over_range, local_depth);
       if (fixed) { // fixed && reclaim
+        int wanted_bucket = needed_bucket;
         bool remap_done = tuning_local_cdf(over_range,
                                         needed_bucket, range_count, local_depth);
+        if (needed_bucket != wanted_bucket)
+          reclaimed++;
         available = remap_available;
         if (remap_done == false) {
           fixed = false;
         }
       }
       if (!fixed) { // !fixed && !reclaim
-        available = tuning_local_cdf_by_range(needed_bucket, over_range, local_depth);
+        available = tuning_local_cdf_by_range(needed_bucket, over_range,
+                                              local_depth, max_bits);
       }
 
       if (available <= 0) { //local remap fail during tuning
         remap_available = available;
-        for (int i = 0; i < ranges; i++) {
-          line[i].gradient = old_line[2*i];
-          line[i].y_intercept = old_line[2*i+1];
-        }
-        old_line.clear();
-        range_count.clear();
+        std::copy(old_line.begin(), old_line.end(), line);
         return NULL;
       }
     }
     else { //local remap fail (already)
-      for (int i = 0; i < ranges; i++) {
-        line[i].gradient = old_line[2*i];
-        line[i].y_intercept = old_line[2*i+1];
-      }
-      old_line.clear();
-      range_count.clear();
+      std::copy(old_line.begin(), old_line.end(), line);
       return NULL;
     }
 
@@ -170,7 +163,7 @@ inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
 
         key_hash = key_hash & local_mask;
         local_key_hash = lcdf(local_depth, key_hash);
-        z = (local_key_hash >> (64 - kDepth - local_depth));
+        z = (local_key_hash >> (kKeyBits - kDepth - local_depth));
         int range = get_local_cdf_range(key_hash, local_depth);
         if (buc_idx != z) {
           buc_idx = z;
@@ -187,7 +180,7 @@ inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
           over_key = key_hash;
           uint64_t tlocal_key_hash = lcdf(local_depth, first_over_key);
           auto temp_z = (
-              tlocal_key_hash >> (64 - kDepth - local_depth));
+              tlocal_key_hash >> (kKeyBits - kDepth - local_depth));
           over_buc = temp_z;
           int prev_range;
           int prev_count = 0;
@@ -218,30 +211,15 @@ inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
 #ifdef SEP
   Key* temp_key_slot;
   Value* temp_val_slot;
-  if (snum <= pool_num) {
-    void* addr = chunk_alloc[snum-1].malloc();
-    temp_key_slot = new(static_cast<Key*>(addr)) \
-           Key[snum*kNumSlot];
-    void* val_addr = addr + sizeof(Key) * snum * kNumSlot;
-    temp_val_slot = new(static_cast<Value*>(val_addr))\
-               Value[snum*kNumSlot];
-  }
-  else {
-    void* addr = malloc(sizeof(Key) * snum * kNumSlot * 2);
-    temp_key_slot = new(static_cast<Key*>(addr)) \
-           Key[snum*kNumSlot];
-    void* val_addr = addr + sizeof(Key) * snum * kNumSlot;
-    temp_val_slot = new(static_cast<Value*>(val_addr))\
-               Value[snum*kNumSlot];
-  }
+  void* addr = ctx.chunk_malloc(snum);
+  temp_key_slot = new(static_cast<Key*>(addr)) \
+         Key[snum*kNumSlot];
+  void* val_addr = addr + sizeof(Key) * snum * kNumSlot;
+  temp_val_slot = new(static_cast<Value*>(val_addr))\
+             Value[snum*kNumSlot];
 #else
-  Pair* temp_slot;
-  if (snum <= pool_num) {
-    temp_slot = new(static_cast<Pair*>(chunk_alloc[snum-1].malloc())) \
-           Pair[snum*kNumSlot];
-  }
-  else
-    temp_slot = new Pair[snum*kNumSlot];
+  Pair* temp_slot = new(static_cast<Pair*>(ctx.chunk_malloc(snum))) \
+         Pair[snum*kNumSlot];
 #endif
   buc_idx = 0;
   buc_num = 0;
@@ -253,7 +231,7 @@ inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
       uint64_t key_hash = key_slot[i].item & y_mask;
       key_hash = key_hash & local_mask;
       local_key_hash = lcdf(local_depth, key_hash);
-      z = (local_key_hash >> (64 - kDepth - local_depth));
+      z = (local_key_hash >> (kKeyBits - kDepth - local_depth));
       if (buc_idx != z) {
         buc_idx = z;
         buc_num = 0;
@@ -265,12 +243,7 @@ inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
 
   // copy remapped data
   remap_available = available;
-  if (seg_num <= pool_num) {
-    chunk_alloc[seg_num-1].free(key_slot);
-  }
-  else {
-    free(key_slot);
-  }
+  ctx.retire_chunk(key_slot, seg_num);
   seg_num = snum;
   key_slot = temp_key_slot;
   val_slot = temp_val_slot;
@@ -282,7 +255,7 @@ inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
       uint64_t key_hash = slot[i].key & y_mask;
       key_hash = key_hash & local_mask;
       local_key_hash = lcdf(local_depth, key_hash);
-      z = (local_key_hash >> (64 - kDepth - local_depth));
+      z = (local_key_hash >> (kKeyBits - kDepth - local_depth));
       if (buc_idx != z) {
         buc_idx = z;
         buc_num = 0;
@@ -294,26 +267,67 @@ inline Directory* Directory::LocalRemap(size_t key, int local_depth) {
 
   // copy remapped data
   remap_available = available;
-  if (seg_num <= pool_num)
-    chunk_alloc[seg_num-1].free(slot);
-  else
-    delete[] slot;
-  //pair_alloc.deallocate(slot, seg_num*kNumSlot);
+  ctx.retire_chunk(slot, seg_num);
   seg_num = snum;
   slot = temp_slot;
 #endif
-  old_line.clear();
-  range_count.clear();
+  if (reclaimed > 0)
+    __atomic_fetch_add(&ctx.reclaims, reclaimed, __ATOMIC_RELAXED);
   return this;
 
 }
 
-inline int Directory::Insert(Key_t& key, Value_t value, size_t key_hash, size_t y) {
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::Insert(Key_t& key, Value_t value, size_t key_hash, size_t y) {
 
   int ret = 1;
 
   auto bucket = block*y; // which number of block
-#ifdef SEP
+#if defined(INSERT_BUFFER)
+  // keys out of order are appended and merged every INSERT_BUFFER_SIZE keys
+  BucketMeta& meta = bucket_meta()[y];
+  int i, count, sorted;
+  if (meta.buffered == 0) {
+    i = exponential_search(key, bucket);
+    if (i > 0 && key_at(bucket+i-1) == key) {
+      value_at(bucket+i-1) = value;
+      return i-1;
+    }
+    if (i == block)
+      return -1;
+    if (key_at(bucket+i) == INVALID) { // in order
+      key_at(bucket+i) = key;
+      value_at(bucket+i) = value;
+      num_key++;
+      return i;
+    }
+    count = bucket_size(bucket);
+    sorted = count;
+  } else {
+    count = meta.count;
+    sorted = count - meta.buffered;
+    i = (sorted == 0) ? 0 : exponential_search(key, bucket, sorted);
+    if (i > 0 && key_at(bucket+i-1) == key) {
+      value_at(bucket+i-1) = value;
+      return i-1;
+    }
+    for (int j = sorted; j < count; j++) {
+      if (key_at(bucket+j) == key) {
+        value_at(bucket+j) = value;
+        return j;
+      }
+    }
+  }
+  if (count == block)
+    return -1;
+  key_at(bucket+count) = key;
+  value_at(bucket+count) = value;
+  num_key++;
+  meta.count = count + 1;
+  if (++meta.buffered == INSERT_BUFFER_SIZE)
+    merge_buffer(y);
+  return count;
+#elif defined(SEP)
   for (int i = 0; i < block; i++) {
     if (key > key_slot[bucket+i].item) {
       continue;
@@ -393,23 +407,37 @@ inline int Directory::Insert(Key_t& key, Value_t value, size_t key_hash, size_t
   return -1;
 }
 
-inline int Directory::Delete(Key_t& key, size_t key_hash, size_t y, bool islock, int local_depth) {
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::Delete(Key_t& key, size_t key_hash, size_t y, bool islock, int local_depth) {
 
   int ret = 1;
 
   auto bucket = block*y;
 
   bool shift = false;
+#ifdef INSERT_BUFFER
+  BucketMeta& meta = bucket_meta()[y];
+  int sorted = meta.count - meta.buffered;
+#endif
 #ifdef SEP
   for (int i = 0; i < block; i++) {
     if (key_slot[bucket+i].item == INVALID)
       break;
     if (!shift && key_slot[bucket+i].item == key) {
-      val_slot[bucket+i].item = (i == 0) ? NULL : val_slot[bucket+i-1].item;
+      val_slot[bucket+i].item = (i == 0) ? NONE : val_slot[bucket+i-1].item;
       shift = true;
       num_key--;
+#ifdef INSERT_BUFFER
+      if (meta.buffered != 0) {
+        meta.count--;
+        if (i >= sorted)
+          meta.buffered--;
+      }
+#endif
     }
-    if (shift) {
+    if (shift && i == block-1) { // do not pull in the next bucket
+      key_slot[bucket+i].item = INVALID;
+    } else if (shift) {
       key_slot[bucket+i].item = key_slot[bucket+i+1].item;
       val_slot[bucket+i].item = val_slot[bucket+i+1].item;
     }
@@ -422,11 +450,20 @@ inline int Directory::Delete(Key_t& key, size_t key_hash, size_t y, bool islock,
     if (slot[bucket+i].key == INVALID)
       break;
     if (!shift && slot[bucket+i].key == key) {
-      slot[bucket+i].value = (i == 0) ? NULL : slot[bucket+i-1].value;
+      slot[bucket+i].value = (i == 0) ? NONE : slot[bucket+i-1].value;
       shift = true;
       num_key--;
+#ifdef INSERT_BUFFER
+      if (meta.buffered != 0) {
+        meta.count--;
+        if (i >= sorted)
+          meta.buffered--;
+      }
+#endif
     }
-    if (shift) {
+    if (shift && i == block-1) { // do not pull in the next bucket
+      slot[bucket+i].key = INVALID;
+    } else if (shift) {
       slot[bucket+i].key = slot[bucket+i+1].key;
       slot[bucket+i].value = slot[bucket+i+1].value;
     }
@@ -438,21 +475,23 @@ inline int Directory::Delete(Key_t& key, size_t key_hash, size_t y, bool islock,
   return 0;
 }
 
-inline Directory** Directory::Split(size_t y, int local_depth) {
+template <typename K, typename V, size_t kNumSlot>
+inline Directory<K, V, kNumSlot>** Directory<K, V, kNumSlot>::Split(size_t y, int local_depth,
+    Context& ctx) {
 
   int sum = 0, sum1 = 0;
   auto seg = kNumSlot;
   Directory** split = new Directory*[2];
-  split_local_cdf(split, local_depth);
+  split_local_cdf(split, local_depth, ctx);
 
   int buc_index[2] = {0, 0};
   int buc_num[2] = {0, 0};
-  uint64_t half = ((uint64_t)1 << (8*sizeof(Key_t)-kDepth-local_depth-1));
+  uint64_t half = ((uint64_t)1 << (kKeyBits-kDepth-local_depth-1));
   uint64_t bound_hash = lcdf(local_depth, half); //remap global remapped key as local remapped
-  auto bound_buc = (bound_hash >> (64 - kDepth - local_depth));
+  auto bound_buc = (bound_hash >> (kKeyBits - kDepth - local_depth));
   int next_local_depth = local_depth + 1;
-  size_t local_mask = ((size_t)1 << (8*sizeof(Key_t)-kDepth-next_local_depth))-1;
-  size_t original_local_mask = ((size_t)1 << (8*sizeof(Key_t)-kDepth-local_depth))-1;
+  size_t local_mask = ((size_t)1 << (kKeyBits-kDepth-next_local_depth))-1;
+  size_t original_local_mask = ((size_t)1 << (kKeyBits-kDepth-local_depth))-1;
   uint64_t key_hash, local_key_hash;
   int z;
   int bound1 = 0;
@@ -461,11 +500,11 @@ inline Directory** Directory::Split(size_t y, int local_depth) {
     if (key_slot[i].item == INVALID)
       break;
     auto key_hash = key_slot[i].item & y_mask;
-    uint64_t split_test = key_hash >> (8*sizeof(Key_t)-kDepth-local_depth-1);
+    uint64_t split_test = key_hash >> (kKeyBits-kDepth-local_depth-1);
     split_test = split_test & 1;
     size_t local_key_hash = key_hash & local_mask;
     local_key_hash = split[split_test]->lcdf(next_local_depth, local_key_hash);
-    auto z = local_key_hash >> (64 - kDepth - next_local_depth);
+    auto z = local_key_hash >> (kKeyBits - kDepth - next_local_depth);
     if (split_test == 1) {
       assert(z*block+ buc_num[1] < split[1]->seg_num*kNumSlot);
       if (z != buc_index[1]) {
@@ -486,7 +525,7 @@ inline Directory** Directory::Split(size_t y, int local_depth) {
       key_hash = key_slot[i].item & y_mask;
       key_hash = key_hash & local_mask;
       local_key_hash = split[1]->lcdf(next_local_depth, key_hash);
-      z = (local_key_hash >> (64 - kDepth - next_local_depth));
+      z = (local_key_hash >> (kKeyBits - kDepth - next_local_depth));
       if (z != buc_index[1]) {
         buc_index[1] = z;
         buc_num[1] = 0;
@@ -508,7 +547,7 @@ inline Directory** Directory::Split(size_t y, int local_depth) {
       key_hash = key_slot[i].item & y_mask;
       key_hash = key_hash & local_mask;
       local_key_hash = split[0]->lcdf(next_local_depth, key_hash);
-      z = (local_key_hash >> (64 - kDepth - next_local_depth));
+      z = (local_key_hash >> (kKeyBits - kDepth - next_local_depth));
       if (z != buc_index[0]) {
         buc_index[0] = z;
         buc_num[0] = 0;
@@ -525,11 +564,11 @@ inline Directory** Directory::Split(size_t y, int local_depth) {
       if (key_slot[i].item == INVALID)
         break;
       auto key_hash = key_slot[i].item & y_mask;
-      uint64_t split_test = key_hash >> (8*sizeof(Key_t)-kDepth-local_depth-1);
+      uint64_t split_test = key_hash >> (kKeyBits-kDepth-local_depth-1);
       split_test = split_test & 1;
       size_t local_key_hash = key_hash & local_mask;
       local_key_hash = split[split_test]->lcdf(next_local_depth, local_key_hash);
-      auto z = (local_key_hash >> (64 - kDepth - next_local_depth));
+      auto z = (local_key_hash >> (kKeyBits - kDepth - next_local_depth));
       if (z != buc_index[0]) {
         buc_index[0] = z;
         buc_num[0] = 0;
@@ -551,11 +590,11 @@ inline Directory** Directory::Split(size_t y, int local_depth) {
     if (slot[i].key == INVALID)
       break;
     auto key_hash = slot[i].key & y_mask;
-    uint64_t split_test = key_hash >> (8*sizeof(Key_t)-kDepth-local_depth-1);
+    uint64_t split_test = key_hash >> (kKeyBits-kDepth-local_depth-1);
     split_test = split_test & 1;
     size_t local_key_hash = key_hash & local_mask;
     local_key_hash = split[split_test]->lcdf(next_local_depth, local_key_hash);
-    auto z = local_key_hash >> (64 - kDepth - next_local_depth);
+    auto z = local_key_hash >> (kKeyBits - kDepth - next_local_depth);
     if (split_test == 1) {
       assert(z*block+ buc_num[1] < split[1]->seg_num*kNumSlot);
       if (z != buc_index[1]) {
@@ -576,7 +615,7 @@ inline Directory** Directory::Split(size_t y, int local_depth) {
       key_hash = slot[i].key & y_mask;
       key_hash = key_hash & local_mask;
       local_key_hash = split[1]->lcdf(next_local_depth, key_hash);
-      z = (local_key_hash >> (64 - kDepth - next_local_depth));
+      z = (local_key_hash >> (kKeyBits - kDepth - next_local_depth));
       if (z != buc_index[1]) {
         buc_index[1] = z;
         buc_num[1] = 0;
@@ -599,7 +638,7 @@ inline Directory** Directory::Split(size_t y, int local_depth) {
       key_hash = slot[i].key & y_mask;
       key_hash = key_hash & local_mask;
       local_key_hash = split[0]->lcdf(next_local_depth, key_hash);
-      z = (local_key_hash >> (64 - kDepth - next_local_depth));
+      z = (local_key_hash >> (kKeyBits - kDepth - next_local_depth));
       if (z != buc_index[0]) {
         buc_index[0] = z;
         buc_num[0] = 0;
@@ -616,11 +655,11 @@ inline Directory** Directory::Split(size_t y, int local_depth) {
       if (slot[i].key == INVALID)
         break;
       auto key_hash = slot[i].key & y_mask;
-      uint64_t split_test = (key_hash >> (8*sizeof(Key_t)-kDepth-local_depth-1));
+      uint64_t split_test = (key_hash >> (kKeyBits-kDepth-local_depth-1));
       split_test = split_test & 1;
       size_t local_key_hash = key_hash & local_mask;
       local_key_hash = split[split_test]->lcdf(next_local_depth, local_key_hash);
-      auto z = (local_key_hash >> (64 - kDepth - next_local_depth));
+      auto z = (local_key_hash >> (kKeyBits - kDepth - next_local_depth));
       if (z != buc_index[0]) {
         buc_index[0] = z;
         buc_num[0] = 0;
@@ -636,16 +675,25 @@ inline Directory** Directory::Split(size_t y, int local_depth) {
     }
 
 
+#endif
+#ifdef CONCURRENT
+  // parked pairs go to their half, still in key order
+  for (uint32_t i = 0; overflow != NULL && i < overflow->num; i++) {
+    Pair& p = overflow->pairs[i];
+    int half = ((p.key & y_mask) >> (kKeyBits-kDepth-local_depth-1)) & 1;
+    split[half]->overflow_insert(p.key, p.value);
+  }
 #endif
   return split;
 }
 
 
 #ifdef SEP
-inline int Directory::exponential_search(Key_t& key, size_t bucket) {
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::exponential_search(Key_t& key, size_t bucket, int n) {
   int bound = 1;
   int l,r;
-  int m =  block * 0.4; // heuristic value
+  int m =  std::min<int>(block * 0.4, n - 1); // heuristic value
   if (key < key_slot[bucket + m].item) {
     int size = m;
     while (bound < size && key_slot[bucket + m - bound].item > key) {
@@ -655,16 +703,21 @@ inline int Directory::exponential_search(Key_t& key, size_t bucket) {
     r = m - bound / 2;
   }
   else {
-    int size = block - m;
+    int size = n - m;
     while (bound < size && key_slot[bucket + m + bound].item <= key) {
       bound *= 2;
     }
     l = m+bound/2;
     r = m+std::min<int>(bound, size);
   }
+#ifdef SIMD_SEARCH
+  return simd_upper_bound(l, r, key, bucket);
+#else
   return binary_search_upper_bound(l, r, key, bucket);
+#endif
 }
-inline int Directory::binary_search_upper_bound(int l, int r, Key_t key, size_t bucket) {
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::binary_search_upper_bound(int l, int r, Key_t key, size_t bucket) {
   while (l < r) {
     int mid = l + (r - l) / 2;
     if (key_slot[bucket + mid].item <= key) {
@@ -676,11 +729,64 @@ inline int Directory::binary_search_upper_bound(int l, int r, Key_t key, size_t
   }
   return l;
 }
+#ifdef SIMD_SEARCH
+// same as binary_search_upper_bound, but counts the keys <= key in [l, r)
+// with vector compares instead of branching on each probe
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::simd_upper_bound(int l, int r, Key_t key, size_t bucket) {
+  const Key_t* keys = &key_slot[bucket].item;
+  int count = 0;
+#if defined(__AVX512F__)
+  if constexpr (sizeof(Key_t) == 8) {
+    __m512i k = _mm512_set1_epi64(key);
+    for (int i = l; i < r; i += 8) {
+      __mmask8 in = (r - i >= 8) ? 0xFF : (__mmask8)((1 << (r - i)) - 1);
+      __m512i v = _mm512_maskz_loadu_epi64(in, keys + i);
+      count += __builtin_popcount(_mm512_mask_cmple_epu64_mask(in, v, k));
+    }
+  } else {
+    __m512i k = _mm512_set1_epi32(key);
+    for (int i = l; i < r; i += 16) {
+      __mmask16 in = (r - i >= 16) ? 0xFFFF : (__mmask16)((1 << (r - i)) - 1);
+      __m512i v = _mm512_maskz_loadu_epi32(in, keys + i);
+      count += __builtin_popcount(_mm512_mask_cmple_epu32_mask(in, v, k));
+    }
+  }
+#elif defined(__AVX2__)
+  // no unsigned compare, so flip the sign bits first
+  int i = l;
+  if constexpr (sizeof(Key_t) == 8) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    __m256i k = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+    for (; i + 4 <= r; i += 4) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(keys + i));
+      __m256i gt = _mm256_cmpgt_epi64(_mm256_xor_si256(v, sign), k);
+      count += 4 - __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(gt)));
+    }
+  } else {
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    __m256i k = _mm256_xor_si256(_mm256_set1_epi32(key), sign);
+    for (; i + 8 <= r; i += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(keys + i));
+      __m256i gt = _mm256_cmpgt_epi32(_mm256_xor_si256(v, sign), k);
+      count += 8 - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt)));
+    }
+  }
+  for (; i < r; i++)
+    count += (keys[i] <= key);
+#else
+  for (int i = l; i < r; i++)
+    count += (keys[i] <= key);
+#endif
+  return l + count;
+}
+#endif
 #else
-inline int Directory::exponential_search(Key_t& key, size_t bucket) {
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::exponential_search(Key_t& key, size_t bucket, int n) {
   int bound = 1;
   int l,r;
-  int m =  block * 0.4; // heuristic value
+  int m =  std::min<int>(block * 0.4, n - 1); // heuristic value
   if (key < slot[bucket + m].key) {
     int size = m;
     while (bound < size && slot[bucket + m - bound].key > key) {
@@ -690,7 +796,7 @@ inline int Directory::exponential_search(Key_t& key, size_t bucket) {
     r = m - bound / 2;
   }
   else {
-    int size = block - m;
+    int size = n - m;
     while (bound < size && slot[bucket + m + bound].key <= key) {
       bound *= 2;
     }
@@ -699,7 +805,8 @@ inline int Directory::exponential_search(Key_t& key, size_t bucket) {
   }
   return binary_search_upper_bound(l, r, key, bucket);
 }
-inline int Directory::binary_search_upper_bound(int l, int r, Key_t key, size_t bucket) {
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::binary_search_upper_bound(int l, int r, Key_t key, size_t bucket) {
   while (l < r) {
     int mid = l + (r - l) / 2;
     if (slot[bucket + mid].key <= key) {
@@ -713,9 +820,24 @@ inline int Directory::binary_search_upper_bound(int l, int r, Key_t key, size_t
 }
 #endif
 
-inline Value_t Directory::Get(Key_t& key, size_t y) {
+template <typename K, typename V, size_t kNumSlot>
+inline V Directory<K, V, kNumSlot>::Get(Key_t& key, size_t y) {
   auto bucket = block*y;
-  size_t result_exp = exponential_search(key, bucket) - 1;
+#ifdef CONCURRENT
+  int parked = overflow_find(key);
+  if (parked != -1)
+    return overflow->pairs[parked].value;
+#endif
+#ifdef INSERT_BUFFER
+  prefetch_bucket(y); // overlap with the miss on the meta
+  if (bucket_meta()[y].buffered != 0) {
+    int i = find_buffered(key, y);
+    return (i == -1) ? NONE : value_at(bucket+i);
+  }
+#endif
+  int result_exp = exponential_search(key, bucket) - 1;
+  if (result_exp < 0) // below the first key of the bucket
+    return NONE;
 #ifdef SEP
   if (key_slot[bucket + result_exp].item == key)
     return val_slot[bucket + result_exp].item;
@@ -730,81 +852,229 @@ inline Value_t Directory::Get(Key_t& key, size_t y) {
 #endif
 }
 
-inline void Directory::Scan(Key_t& min, int& count, size_t n, size_t z, Value_t* result) {
-  Key_t k = min;
-  Directory* current = this;
+// cache line where exponential_search of bucket y starts
+template <typename K, typename V, size_t kNumSlot>
+inline void Directory<K, V, kNumSlot>::prefetch_bucket(size_t y) {
+  int m = block * 0.4;
+#ifdef SEP
+  __builtin_prefetch(&key_slot[block*y + m]);
+#else
+  __builtin_prefetch(&slot[block*y + m]);
+#endif
+}
 
-  auto bucket = block*z;
-  size_t result_exp = 0;
-  if (min != 0)
-    result_exp = exponential_search(min, bucket);
-  size_t index = result_exp > 0 ? bucket + result_exp -1 : bucket + result_exp;
+// first slot of the segment holding a key >= key
+template <typename K, typename V, size_t kNumSlot>
+inline size_t Directory<K, V, kNumSlot>::scan_position(Key_t& key, int local_depth) {
+  size_t local_mask = ((size_t)1 << (kKeyBits-kDepth-local_depth))-1;
+  size_t local_key_hash = lcdf(local_depth, key & y_mask & local_mask);
+  size_t z = (local_key_hash >> (kKeyBits - kDepth - local_depth));
+  if (z >= seg_num) // only while a concurrent writer changes the local cdf
+    return seg_num * block;
+  if (key == 0)
+    return block*z;
+  Key_t prev = key - 1;
+#ifdef INSERT_BUFFER
+  if (bucket_meta()[z].buffered != 0) // rank in key order
+    return block*z + buffered_upper_bound(prev, z);
+#endif
+  return block*z + exponential_search(prev, block*z);
+}
 
-#ifdef SEP
-  Value* cur_val_slot = current->val_slot;
-  size_t cur_seg_num = current->seg_num;
-  while (count < n) {
-    if (cur_val_slot[index].item != INVALID) {
-      result[count++] = cur_val_slot[index].item;
-      index++;
-      if (index == cur_seg_num * block) {
-        current = current->sibling;
-        if (current == NULL)
-          return;
-        cur_val_slot = current->val_slot;
-        cur_seg_num = current->seg_num;
-        index = 0;
+// visit pairs from slot pos in key order until f returns false.
+// pos is left at the slot next to the last visited pair.
+// (with INSERT_BUFFER, pos % block is the rank in key order within the bucket)
+template <typename K, typename V, size_t kNumSlot>
+template <typename F>
+inline bool Directory<K, V, kNumSlot>::Scan(size_t& pos, F&& f) {
+  size_t end = seg_num * block;
+  while (pos < end) {
+#ifdef INSERT_BUFFER
+    size_t y = pos / block;
+#ifndef CONCURRENT
+    if (bucket_meta()[y].buffered != 0) // no reader to race with
+      merge_buffer(y);
+#endif
+    if (bucket_meta()[y].buffered != 0) {
+      Key_t keys[block];
+      Value_t values[block];
+      int count = sorted_bucket(y, keys, values);
+      for (int r = pos % block; r < count; r++) {
+        pos++;
+        if (!f(keys[r], values[r]))
+          return false;
       }
+      pos = block*(y+1);
+      continue;
     }
-    else {
-      index += (block - index % block);
-      if (index >= cur_seg_num * block) {
-        current = current->sibling;
-        if (current == NULL)
-          return;
-        cur_val_slot = current->val_slot;
-        cur_seg_num = current->seg_num;
-        index = 0;
-      }
+#endif
+#ifdef SEP
+    if (key_slot[pos].item == INVALID) {
+      pos += (block - pos % block);
+      continue;
+    }
+    Key_t key = key_slot[pos].item;
+    Value_t value = val_slot[pos].item;
+#else
+    if (slot[pos].key == INVALID) {
+      pos += (block - pos % block);
+      continue;
     }
+    Key_t key = slot[pos].key;
+    Value_t value = slot[pos].value;
+#endif
+    pos++;
+    if (!f(key, value))
+      return false;
+  }
+  return true;
+}
+
+#ifdef INSERT_BUFFER
+// # of occupied slots, they are followed by INVALID
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::bucket_size(size_t bucket) {
+  int l = 0, r = block;
+  while (l < r) {
+    int mid = l + (r - l) / 2;
+    if (key_at(bucket+mid) != INVALID)
+      l = mid + 1;
+    else
+      r = mid;
   }
+  return l;
+}
 
-#else
-  Pair* cur_slot = current->slot;
-  size_t cur_seg_num = current->seg_num;
-  while (count < n) {
-    if (cur_slot[index].value != INVALID) {
-      result[count++] = cur_slot[index].value;
-      index++;
-      if (index == cur_seg_num * block) {
-        current = current->sibling;
-        if (current == NULL)
-          return;
-        index = 0;
-        cur_slot = current->slot;
-        cur_seg_num = current->seg_num;
-      }
+// [sorted, count) of bucket y holds the buffered keys.
+// clamped, as a concurrent reader may see a half-updated meta.
+template <typename K, typename V, size_t kNumSlot>
+inline void Directory<K, V, kNumSlot>::buffered_range(size_t y, int& sorted, int& count) {
+  BucketMeta meta = bucket_meta()[y];
+  count = std::min<int>(meta.count, block);
+  sorted = count - std::min<int>({meta.buffered, count, INSERT_BUFFER_SIZE});
+}
+
+// sort the buffered keys of bucket y into keys/values, return their number
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::sort_buffer(size_t y, int sorted,
+    int count, Key_t* keys, Value_t* values) {
+  auto bucket = block*y;
+  int buffered = count - sorted;
+  for (int j = 0; j < buffered; j++) {
+    Key_t k = key_at(bucket+sorted+j);
+    Value_t v = value_at(bucket+sorted+j);
+    int l = j;
+    for (; l > 0 && keys[l-1] > k; l--) {
+      keys[l] = keys[l-1];
+      values[l] = values[l-1];
     }
-    else {
-      index += (block - index % block);
-      if (index >= cur_seg_num * block) {
-        current = current->sibling;
-        if (current == NULL)
-          return;
-        index = 0;
-        cur_slot = current->slot;
-        cur_seg_num = current->seg_num;
-      }
+    keys[l] = k;
+    values[l] = v;
+  }
+  return buffered;
+}
+
+// copy bucket y in key order, return the number of pairs
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::sorted_bucket(size_t y, Key_t* keys, Value_t* values) {
+  auto bucket = block*y;
+  int sorted, count;
+  buffered_range(y, sorted, count);
+  Key_t buf_keys[INSERT_BUFFER_SIZE];
+  Value_t buf_values[INSERT_BUFFER_SIZE];
+  int j = sort_buffer(y, sorted, count, buf_keys, buf_values) - 1;
+  // merge with the sorted run from the back
+  int i = sorted - 1;
+  for (int out = count - 1; out >= 0; out--) {
+    if (j >= 0 && (i < 0 || buf_keys[j] > key_at(bucket+i))) {
+      keys[out] = buf_keys[j];
+      values[out] = buf_values[j--];
+    } else {
+      keys[out] = key_at(bucket+i);
+      values[out] = value_at(bucket+i--);
     }
   }
-#endif
+  return count;
+}
 
+// slot of key in bucket y with buffered keys, -1 if not found
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::find_buffered(Key_t& key, size_t y) {
+  auto bucket = block*y;
+  int sorted, count;
+  buffered_range(y, sorted, count);
+  int i = (sorted == 0) ? 0 : exponential_search(key, bucket, sorted);
+  if (i > 0 && key_at(bucket+i-1) == key)
+    return i-1;
+  for (int j = sorted; j < count; j++) {
+    if (key_at(bucket+j) == key)
+      return j;
+  }
+  return -1;
 }
 
-inline Value_t* Directory::Find(Key_t& key, size_t y) {
+// # of keys <= key in bucket y with buffered keys
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::buffered_upper_bound(Key_t key, size_t y) {
+  auto bucket = block*y;
+  int sorted, count;
+  buffered_range(y, sorted, count);
+  int rank = (sorted == 0) ? 0 : exponential_search(key, bucket, sorted);
+  for (int j = sorted; j < count; j++)
+    rank += (key_at(bucket+j) <= key);
+  return rank;
+}
+
+// merge in place from the back, keys smaller than every buffered key stay
+template <typename K, typename V, size_t kNumSlot>
+inline void Directory<K, V, kNumSlot>::merge_buffer(size_t y) {
+  if (bucket_meta()[y].buffered == 0)
+    return;
+  auto bucket = block*y;
+  int sorted, count;
+  buffered_range(y, sorted, count);
+  Key_t buf_keys[INSERT_BUFFER_SIZE];
+  Value_t buf_values[INSERT_BUFFER_SIZE];
+  int j = sort_buffer(y, sorted, count, buf_keys, buf_values) - 1;
+  int i = sorted - 1;
+  for (int out = count - 1; j >= 0; out--) {
+    if (i < 0 || buf_keys[j] > key_at(bucket+i)) {
+      key_at(bucket+out) = buf_keys[j];
+      value_at(bucket+out) = buf_values[j--];
+    } else {
+      key_at(bucket+out) = key_at(bucket+i);
+      value_at(bucket+out) = value_at(bucket+i--);
+    }
+  }
+  bucket_meta()[y].buffered = 0;
+}
+
+// structural changes (remap, expand, split) expect sorted buckets
+template <typename K, typename V, size_t kNumSlot>
+inline void Directory<K, V, kNumSlot>::flush_buffers(void) {
+  for (size_t y = 0; y < seg_num; y++)
+    merge_buffer(y);
+}
+#endif
+
+template <typename K, typename V, size_t kNumSlot>
+inline V* Directory<K, V, kNumSlot>::Find(Key_t& key, size_t y) {
 
   auto bucket = block*y;
-  size_t result_exp = exponential_search(key, bucket) - 1;
+#ifdef CONCURRENT
+  int parked = overflow_find(key);
+  if (parked != -1)
+    return &overflow->pairs[parked].value;
+#endif
+#ifdef INSERT_BUFFER
+  if (bucket_meta()[y].buffered != 0) {
+    int i = find_buffered(key, y);
+    return (i == -1) ? NULL : &value_at(bucket+i);
+  }
+#endif
+  int result_exp = exponential_search(key, bucket) - 1;
+  if (result_exp < 0) // below the first key of the bucket
+    return NULL;
 #ifdef SEP
   if (key_slot[bucket + result_exp].item == key)
     return &val_slot[bucket + result_exp].item;
@@ -818,21 +1088,41 @@ inline Value_t* Directory::Find(Key_t& key, size_t y) {
 #endif
 }
 
-inline bool Directory::Expand(int local_depth, int rbits) {
-  int max_seg_size = max_bucket_num(local_depth);
+#ifdef CONCURRENT
+// park a key that is in neither the slots nor the overflow, false if the
+// overflow is full. readers see the segment dirty meanwhile
+template <typename K, typename V, size_t kNumSlot>
+inline bool Directory<K, V, kNumSlot>::overflow_insert(Key_t key, Value_t value) {
+  if (overflow == NULL)
+    overflow = new Overflow_t();
+  if (overflow->num == OVERFLOW_SIZE)
+    return false;
+  int i = overflow->num;
+  for (; i > 0 && overflow->pairs[i-1].key > key; i--)
+    overflow->pairs[i] = overflow->pairs[i-1];
+  overflow->pairs[i] = Pair(key, value);
+  overflow->num++;
+  return true;
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void Directory<K, V, kNumSlot>::overflow_erase(int i) {
+  for (uint32_t j = i + 1; j < overflow->num; j++)
+    overflow->pairs[j-1] = overflow->pairs[j];
+  overflow->num--;
+}
+#endif
+
+template <typename K, typename V, size_t kNumSlot>
+inline bool Directory<K, V, kNumSlot>::Expand(int local_depth, int rbits,
+    int max_bits, Context& ctx) {
+  int max_seg_size = max_seg_num(local_depth, max_bits);
   if (seg_num*2 > max_seg_size)
     return false;
   if (line != NULL) {
     int ranges = (1 << rbits);
-    uint64_t limit_stride = ((size_t)1 << (64-kDepth-local_depth));
-    uint64_t one_range = limit_stride >> rbits;
-    line[0].gradient *= 2;
-    for (int i = 1; i < ranges; i++) {
-      size_t left = one_range*i;
-      size_t left_y = left*line[i-1].gradient+line[i-1].y_intercept;
-      line[i].gradient *= 2;
-      line[i].y_intercept = (double)left_y - line[i].gradient*(double)left;
-    }
+    for (int i = 0; i < ranges; i++)
+      line[i].end *= 2;
   }
 
   int prev_seg_num = seg_num;
@@ -840,34 +1130,19 @@ inline bool Directory::Expand(int local_depth, int rbits) {
 #ifdef SEP
   Key* temp_key_slot;
   Value* temp_val_slot;
-  if (seg_num <= pool_num) {
-    void* addr = chunk_alloc[seg_num-1].malloc();
-    temp_key_slot = new(static_cast<Key*>(addr)) \
-           Key[seg_num*kNumSlot];
-    void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
-    temp_val_slot = new(static_cast<Value*>(val_addr))\
-               Value[seg_num*kNumSlot];
-  }
-  else {
-    void* addr = malloc(sizeof(Key)*seg_num*kNumSlot*2);
-    temp_key_slot = new(static_cast<Key*>(addr)) \
-           Key[seg_num*kNumSlot];
-    void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
-    temp_val_slot = new(static_cast<Value*>(val_addr))\
-               Value[seg_num*kNumSlot];
-  }
+  void* addr = ctx.chunk_malloc(seg_num);
+  temp_key_slot = new(static_cast<Key*>(addr)) \
+         Key[seg_num*kNumSlot];
+  void* val_addr = addr + sizeof(Key) * seg_num * kNumSlot;
+  temp_val_slot = new(static_cast<Value*>(val_addr))\
+             Value[seg_num*kNumSlot];
 #else
-  Pair* temp_slot;
-  if (seg_num <= pool_num) {
-    temp_slot = new(static_cast<Pair*>(chunk_alloc[seg_num-1].malloc())) \
-           Pair[seg_num*kNumSlot];
-  }
-  else
-    temp_slot = new Pair[seg_num*kNumSlot];
+  Pair* temp_slot = new(static_cast<Pair*>(ctx.chunk_malloc(seg_num))) \
+         Pair[seg_num*kNumSlot];
 #endif
   int buc_idx = 0;
   int buc_num = 0;
-  size_t local_mask = ((size_t)1 << (8*sizeof(Key_t)-kDepth-local_depth))-1;
+  size_t local_mask = ((size_t)1 << (kKeyBits-kDepth-local_depth))-1;
 
 #ifdef SEP
   for (uint32_t k = 0; k < prev_seg_num; k++) { // for each bucket
@@ -877,7 +1152,7 @@ inline bool Directory::Expand(int local_depth, int rbits) {
       uint64_t key_hash = key_slot[i].item & y_mask;
       key_hash = key_hash & local_mask;
       size_t local_key_hash = lcdf(local_depth, key_hash);
-      auto z = (local_key_hash >> (64 - kDepth - local_depth));
+      auto z = (local_key_hash >> (kKeyBits - kDepth - local_depth));
       if (buc_idx != z) {
         buc_idx = z;
         buc_num = 0;
@@ -886,12 +1161,7 @@ inline bool Directory::Expand(int local_depth, int rbits) {
       temp_key_slot[z*block + buc_num++].item = key_slot[i].item;
     }
   }
-  if (prev_seg_num <= pool_num) {
-    chunk_alloc[prev_seg_num-1].free(key_slot);
-  }
-  else {
-    free(key_slot);
-  }
+  ctx.retire_chunk(key_slot, prev_seg_num);
   key_slot = temp_key_slot;
   val_slot = temp_val_slot;
 #else
@@ -902,7 +1172,7 @@ inline bool Directory::Expand(int local_depth, int rbits) {
       uint64_t key_hash = slot[i].key & y_mask;
       key_hash = key_hash & local_mask;
       size_t local_key_hash = lcdf(local_depth, key_hash);
-      auto z = (local_key_hash >> (64 - kDepth - local_depth));
+      auto z = (local_key_hash >> (kKeyBits - kDepth - local_depth));
       if (buc_idx != z) {
         buc_idx = z;
         buc_num = 0;
@@ -911,10 +1181,7 @@ inline bool Directory::Expand(int local_depth, int rbits) {
       temp_slot[z*block + buc_num++].key = slot[i].key;
     }
   }
-  if (prev_seg_num <= pool_num)
-    chunk_alloc[prev_seg_num-1].free(slot);
-  else
-    delete[] slot;
+  ctx.retire_chunk(slot, prev_seg_num);
 
   slot = temp_slot;
 #endif
@@ -924,106 +1191,194 @@ inline bool Directory::Expand(int local_depth, int rbits) {
 
 }
 
+// for bulk load
+// build a segment of local_depth from kv[0..n), sorted and within the hash
+// range of the segment. seg_num and the local cdf are chosen from the keys:
+// uniform mapping (as after Expand) if it keeps every bucket under
+// BULK_LOAD_FILL, else one line per range with buckets for its keys.
+// return NULL if the keys need more than max_bucket_num(local_depth) buckets,
+// unless force is set; then pairs not fitting their bucket are put to rest.
+template <typename K, typename V, size_t kNumSlot>
+inline Directory<K, V, kNumSlot>* Directory<K, V, kNumSlot>::BulkLoad(
+    const Pair* kv, size_t n, int local_depth, bool force,
+    std::vector<Pair>& rest, Context& ctx) {
+  size_t cap = block * BULK_LOAD_FILL;
+  size_t local_mask = ((size_t)1 << (kKeyBits-kDepth-local_depth))-1;
+  uint64_t limit_stride = ((uint64_t)1 << (kKeyBits - kDepth - local_depth));
+  int max_seg_num = ctx.max_bucket_num(local_depth, ctx.max_bits); // of a new EH
+  Directory* dir = NULL;
+  std::vector<size_t> count;
+
+  if (n <= cap)
+    dir = ctx.new_segment(local_depth);
+  else if (n > max_seg_num * cap && !force)
+    return NULL;
+
+  for (int snum = 2; dir == NULL && snum <= max_seg_num; snum *= 2) {
+    if (n > snum * cap)
+      continue;
+    count.assign(snum, 0);
+    bool fit = true;
+    for (size_t i = 0; i < n && fit; i++) {
+      size_t key_hash = kv[i].key & y_mask & local_mask;
+      auto z = (snum * key_hash) >> (kKeyBits - kDepth - local_depth);
+      fit = (++count[z] <= cap);
+    }
+    if (fit)
+      dir = ctx.new_segment(local_depth, snum);
+  }
+
+  int max_rbits = std::min(RANGE_BITS_LIMIT, (int)(kKeyBits - kDepth - local_depth));
+  for (int rbits = 1; dir == NULL && rbits <= max_rbits
+       && (1 << rbits) <= max_seg_num; rbits++) {
+    int ranges = (1 << rbits);
+    count.assign(ranges, 0);
+    for (size_t i = 0; i < n; i++) {
+      size_t key_hash = kv[i].key & y_mask & local_mask;
+      count[key_hash >> (kKeyBits - kDepth - local_depth - rbits)]++;
+    }
+    int snum = 0;
+    for (int i = 0; i < ranges; i++)
+      snum += std::max<size_t>(1, (count[i] + cap - 1) / cap);
+    if (snum > max_seg_num)
+      break;
+
+    Directory* seg = ctx.new_segment(local_depth, snum);
+    seg->range_bits = rbits;
+    seg->line = ctx.line_malloc(rbits);
+    uint64_t first_bucket = 0;
+    for (int i = 0; i < ranges; i++) {
+      first_bucket += std::max<size_t>(1, (count[i] + cap - 1) / cap);
+      seg->line[i].end = first_bucket * limit_stride;
+    }
+    // keys may still crowd a bucket inside their range
+    count.assign(snum, 0);
+    bool fit = true;
+    for (size_t i = 0; i < n && fit; i++) {
+      size_t key_hash = kv[i].key & y_mask & local_mask;
+      auto z = seg->lcdf(local_depth, key_hash) >> (kKeyBits - kDepth - local_depth);
+      fit = (z < snum && ++count[z] <= block);
+    }
+    if (fit) {
+      dir = seg;
+    } else {
+      ctx.free_segment(seg);
+    }
+  }
+
+  if (dir == NULL) {
+    if (!force)
+      return NULL;
+    dir = ctx.new_segment(local_depth, max_seg_num);
+  }
+
+  // fill buckets in key order
+  count.assign(dir->seg_num, 0);
+  for (size_t i = 0; i < n; i++) {
+    size_t key_hash = kv[i].key & y_mask & local_mask;
+    auto z = dir->lcdf(local_depth, key_hash) >> (kKeyBits - kDepth - local_depth);
+    if (z >= dir->seg_num || count[z] == block) {
+      rest.push_back(kv[i]);
+      continue;
+    }
+    auto index = z*block + count[z];
+#ifdef SEP
+    if (count[z] > 0 && dir->key_slot[index-1].item == kv[i].key) {
+      dir->val_slot[index-1].item = kv[i].value; // duplicate, keep the last
+      continue;
+    }
+    dir->key_slot[index].item = kv[i].key;
+    dir->val_slot[index].item = kv[i].value;
+#else
+    if (count[z] > 0 && dir->slot[index-1].key == kv[i].key) {
+      dir->slot[index-1].value = kv[i].value; // duplicate, keep the last
+      continue;
+    }
+    dir->slot[index].key = kv[i].key;
+    dir->slot[index].value = kv[i].value;
+#endif
+    count[z]++;
+    dir->num_key++;
+  }
+  dir->remap_available = dir->seg_num;
+  return dir;
+}
+
 // for local cdf
-inline void Directory::split_local_cdf(Directory** split, int local_depth) {
+template <typename K, typename V, size_t kNumSlot>
+inline void Directory<K, V, kNumSlot>::split_local_cdf(Directory** split, int local_depth,
+    Context& ctx) {
 
   if (line == NULL) { // uniform segment
-    split[0] = new(seg_alloc.allocate(1))Directory(local_depth+1, seg_num);
-    split[1] = new(seg_alloc.allocate(1))Directory(local_depth+1, seg_num);
+    split[0] = ctx.new_segment(local_depth+1, seg_num);
+    split[1] = ctx.new_segment(local_depth+1, seg_num);
     return;
   }
 
-  uint64_t limit = ((uint64_t)1 << (64 - kDepth - local_depth));
-  uint64_t one_range = limit >> range_bits;
+  uint64_t limit = ((uint64_t)1 << (kKeyBits - kDepth - local_depth));
   int before_range = (1 << range_bits);
-  uint64_t limit_y = limit * line[before_range-1].gradient + line[before_range-1].y_intercept;
-  uint64_t next_limit = ((uint64_t)1 << (64 - kDepth - (local_depth + 1)));
-  uint32_t PRACTICAL_MAX_SEG_NUM = max_bucket_num(local_depth);
+  uint64_t limit_y = line[before_range-1].end;
+  uint64_t next_limit = ((uint64_t)1 << (kKeyBits - kDepth - (local_depth + 1)));
   uint64_t last_y[2];
   last_y[1] = limit_y;
-  uint64_t half_last = limit / 2; // half of local cdf range
-  last_y[0] = half_last * line[before_range/2-1].gradient + line[before_range/2-1].y_intercept;
+  last_y[0] = line[before_range/2-1].end; // half of local cdf range
   last_y[1] -= (last_y[0] - last_y[0] % limit);
-  int snum[2] = {0,};
-  for (int32_t i = PRACTICAL_MAX_SEG_NUM*2-1; i >= 0; i--) {
-    if (last_y[0] > next_limit*i) {
-      snum[0] = (i+1);
-      break;
-    }
-  }
-  for (int32_t i = PRACTICAL_MAX_SEG_NUM*2-1; i >= 0; i--) {
-    if (last_y[1] > next_limit*i) {
-      snum[1] = (i+1);
-      break;
-    }
-  }
-  split[0] = new(seg_alloc.allocate(1))Directory(local_depth+1, snum[0]);
-  split[1] = new(seg_alloc.allocate(1))Directory(local_depth+1, snum[1]);
+  // buckets covering each half, as many as the segment had if its EH has
+  // since gone back to fewer max bits
+  int snum[2];
+  for (int i = 0; i < 2; i++)
+    snum[i] = (last_y[i] + next_limit - 1) / next_limit;
+  split[0] = ctx.new_segment(local_depth+1, snum[0]);
+  split[1] = ctx.new_segment(local_depth+1, snum[1]);
 
   if (range_bits == 1) { // mininum # of ranges
     // [TODO] : if snum is 2^n, lcdf is not essential
     split[0]->range_bits = range_bits;
     split[1]->range_bits = range_bits;
-    split[0]->line = static_cast<LineFriends*>(line_alloc[0].malloc());
-    split[1]->line = static_cast<LineFriends*>(line_alloc[0].malloc());
+    split[0]->line = ctx.line_malloc(1);
+    split[1]->line = ctx.line_malloc(1);
     for (int i = 0; i < 2; i++) { // minimum % of ranges (2)
-      split[0]->line[i].gradient = line[0].gradient;
-      split[0]->line[i].y_intercept = 0;
-      split[1]->line[i].gradient = line[1].gradient;
-      split[1]->line[i].y_intercept = 0;
+      split[0]->line[i].end = line[0].end / 2 * (i+1);
+      split[1]->line[i].end = (line[1].end - line[0].end) / 2 * (i+1);
     }
   }
   else {
     split[0]->range_bits = range_bits-1;
     split[1]->range_bits = range_bits-1;
-    if ((range_bits-1) <= 10) {
-      split[0]->line = static_cast<LineFriends*>(line_alloc[range_bits-2].malloc());
-      split[1]->line = static_cast<LineFriends*>(line_alloc[range_bits-2].malloc());
-    }
-    else {
-      split[0]->line = new LineFriends[before_range/2]; // 2 * (before_range/2)
-      split[1]->line = new LineFriends[before_range/2];
-    }
-    memcpy(split[0]->line, line, sizeof(double) * before_range);
-    memcpy(split[1]->line, line + before_range/2, sizeof(double) * before_range);
+    split[0]->line = ctx.line_malloc(range_bits-1);
+    split[1]->line = ctx.line_malloc(range_bits-1);
+    memcpy(split[0]->line, line, sizeof(LineFriends) * before_range/2);
+    // split[1] starts at the bucket holding the middle of this segment
     uint64_t left_y = last_y[0] - last_y[0] % limit;
-    uint64_t right = one_range * (1 + before_range/2);
-    uint64_t right_y = split[1]->line[0].gradient * right + split[1]->line[0].y_intercept;
-    double gradient = (double)(right_y-left_y) / (double)one_range;
-    split[1]->line[0].gradient = gradient;
-    split[1]->line[0].y_intercept = 0;
-    for (int i = 1; i < before_range/2; i++) {
-      uint64_t left_y = split[1]->line[i-1].gradient * one_range * i + split[1]->line[i-1].y_intercept;
-      split[1]->line[i].y_intercept = (double)left_y - split[1]->line[i].gradient*one_range*i;
-    }
+    for (int i = 0; i < before_range/2; i++)
+      split[1]->line[i].end = line[before_range/2+i].end - left_y;
   }
 }
 
-inline int Directory::get_local_cdf_range (size_t key, int local_depth) {
-  int target_range = key >> (64-kDepth-local_depth-range_bits);
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::get_local_cdf_range(size_t key, int local_depth) {
+  int target_range = key >> (kKeyBits - kDepth-local_depth-range_bits);
   return target_range;
 }
 
-inline int Directory::get_bucket_increase (int range, int local_depth) {
-  uint64_t limit_stride = ((uint64_t)1 << (64 - kDepth - local_depth));
-  uint64_t  one_range = limit_stride >> range_bits;
-  double one_bucket_gradient = (double)limit_stride / one_range;
-  double how_many_buckets = std::ceil(line[range].gradient/one_bucket_gradient);
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::get_bucket_increase(int range, int local_depth) {
+  uint64_t limit_stride = ((uint64_t)1 << (kKeyBits - kDepth - local_depth));
+  uint64_t width = line[range].end - range_start(range);
+  uint64_t how_many_buckets = (width + limit_stride - 1) / limit_stride;
   return how_many_buckets < 1 ? 1 : how_many_buckets;
 }
 
-// reclaim gradient as much as bucket delta and give it to the range
-inline bool Directory::tuning_local_cdf (int range, int& needed_bucket,
-                                         std::vector<int>& range_count, int local_depth) {
-  uint64_t limit_stride = ((uint64_t)1 << (64 - kDepth - local_depth));
-  uint64_t one_range = limit_stride >> range_bits;
-  double one_bucket_gradient = (double)limit_stride / one_range;
-  double one_bucket_shifting = (double)limit_stride;
-  double delta_gradient = one_bucket_gradient * needed_bucket;
+// reclaim buckets as much as needed_bucket and give them to the range
+template <typename K, typename V, size_t kNumSlot>
+inline bool Directory<K, V, kNumSlot>::tuning_local_cdf(int range,
+    int& needed_bucket, std::vector<int>& range_count, int local_depth) {
+  uint64_t limit_stride = ((uint64_t)1 << (kKeyBits - kDepth - local_depth));
+  int delta_bucket = needed_bucket;
   int ranges = (1 << range_bits);
   int new_reclaim_flag = -1;
   for (int i = reclaim_flag; i < ranges; i++) {
-    double how_many_buckets = line[i].gradient/one_bucket_gradient;
+    double how_many_buckets = (double)(line[i].end - range_start(i)) / limit_stride;
     // if util is >= RECLAIM_THRE then it means this range has util enough util
     double util = range_count[i]/(how_many_buckets*block);
     if (util >= RECLAIM_THRE || i == range) {
@@ -1031,48 +1386,21 @@ inline bool Directory::tuning_local_cdf (int range, int& needed_bucket,
     }
     else {
       int taken_bucket = ceil((1-util) * how_many_buckets);
-      bool enough = false;
       if (taken_bucket >= how_many_buckets)
         taken_bucket--;
-      if (taken_bucket > needed_bucket) {
-        enough = true;
+      if (taken_bucket > needed_bucket)
         taken_bucket = needed_bucket;
-      }
       if (taken_bucket == 0)
         continue;
       if (new_reclaim_flag == -1)
         new_reclaim_flag = i;
-      double new_gradient = line[i].gradient - taken_bucket*one_bucket_gradient;
       assert(taken_bucket > 0 && taken_bucket < how_many_buckets);
-      size_t left = one_range*i;
-      size_t left_y = left*line[i].gradient+line[i].y_intercept;
-      size_t right = one_range*(i+1);
-      double right_y = right*line[i].gradient+line[i].y_intercept;
-      line[i].gradient = new_gradient;
-      line[i].y_intercept = (double)left_y - line[i].gradient*(double)left;
-      double after_right_y = right*line[i].gradient+line[i].y_intercept;
-      double shifting = after_right_y - right_y;
-      assert((uint64_t)shifting%limit_stride == 0);
-      for (int j = (i+1); j < ranges; j++) {
-        line[j].y_intercept += shifting;
-      }
+      shift_ranges(i, -(int64_t)(taken_bucket * limit_stride));
       needed_bucket -= taken_bucket;
       if (needed_bucket == 0) {
-        // give the gradient collected to the target range
-        size_t left = one_range*range;
-        size_t left_y = left*line[range].gradient+line[range].y_intercept;
-        size_t right = one_range*(range+1);
-        double right_y = right*line[range].gradient+line[range].y_intercept;
-        line[range].gradient += delta_gradient;
-        line[range].y_intercept = (double)left_y - line[range].gradient*(double)left;
-        double after_right_y = right*line[range].gradient+line[range].y_intercept;
+        // give the buckets collected to the target range
+        shift_ranges(range, delta_bucket * limit_stride);
         range_count[range] *= 2;
-        double shifting = after_right_y - right_y;
-        assert(shifting > 0);
-        assert((uint64_t)shifting%limit_stride == 0);
-        for (int j = (range+1); j < ranges; j++) {
-          line[j].y_intercept += shifting;
-        }
         // update raclaim_flag
         reclaim_flag = new_reclaim_flag;
         return true;
@@ -1080,24 +1408,11 @@ inline bool Directory::tuning_local_cdf (int range, int& needed_bucket,
     }
   }
 
-  if (delta_gradient != one_bucket_gradient*needed_bucket) {
-    size_t left = one_range*range;
-    size_t left_y = left*line[range].gradient+line[range].y_intercept;
-    size_t right = one_range*(range+1);
-    double right_y = right*line[range].gradient+line[range].y_intercept;
-    line[range].gradient += (delta_gradient - one_bucket_gradient*needed_bucket);
-    line[range].y_intercept = (double)left_y - line[range].gradient*(double)left;
-    double after_right_y = right*line[range].gradient+line[range].y_intercept;
-    double shifting = after_right_y - right_y;
-    assert(shifting > 0);
-    assert((uint64_t)shifting%limit_stride == 0);
-    for (int j = (range+1); j < ranges; j++) {
-      line[j].y_intercept += shifting;
-    }
+  if (needed_bucket != delta_bucket) {
+    shift_ranges(range, (delta_bucket - needed_bucket) * limit_stride);
     // update raclaim_flag
     reclaim_flag = new_reclaim_flag;
-    size_t last = one_range*ranges;
-    size_t last_y = last*line[ranges-1].gradient+line[ranges-1].y_intercept;
+    uint64_t last_y = line[ranges-1].end;
     remap_available = last_y/limit_stride;
     if (last_y % limit_stride != 0)
       remap_available += 1;
@@ -1105,21 +1420,17 @@ inline bool Directory::tuning_local_cdf (int range, int& needed_bucket,
   return false;
 }
 
-// always when fixed is false, give gradient for needed buckets to the range
-inline int Directory::tuning_local_cdf_by_range(int needed_bucket, int range, int local_depth) {
+// always when fixed is false, give needed buckets to the range
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::tuning_local_cdf_by_range(int needed_bucket,
+    int range, int local_depth, int max_bits) {
   int over_range = range;
   int ranges = (1 << range_bits);
   assert(range < ranges);
-  uint64_t limit_stride = ((uint64_t)1 << (64 - kDepth - local_depth));
-  uint64_t one_range = limit_stride / ranges;
-  size_t left = one_range*over_range;
-  size_t right = one_range*(1+over_range);
-  size_t left_y = left*line[over_range].gradient+line[over_range].y_intercept;
-  size_t last = one_range*ranges;
-  size_t last_y = last*line[ranges-1].gradient+line[ranges-1].y_intercept;
-  uint32_t PRACTICAL_MAX_SEG_NUM = max_bucket_num(local_depth);
+  uint64_t limit_stride = ((uint64_t)1 << (kKeyBits - kDepth - local_depth));
+  uint64_t last_y = line[ranges-1].end;
+  uint32_t PRACTICAL_MAX_SEG_NUM = max_seg_num(local_depth, max_bits);
   uint64_t max = PRACTICAL_MAX_SEG_NUM*limit_stride;
-  double bucket_gradient = (double) needed_bucket * limit_stride / one_range;
 
   if (last_y >= max) {
     return -1;
@@ -1129,40 +1440,34 @@ inline int Directory::tuning_local_cdf_by_range(int needed_bucket, int range, in
     return -1;
   }
 
-  double gradient, delta;
-  uint64_t increasing;
-  gradient = line[over_range].gradient + bucket_gradient;
-  double y_intercept = (double)left_y - gradient*(double)left;
-
-  size_t right_y = right*line[over_range].gradient+line[over_range].y_intercept;
-  size_t after_right_y = right*gradient+y_intercept;
-  increasing = after_right_y - right_y;
-  line[over_range].gradient = gradient;
-  line[over_range].y_intercept = y_intercept;
-  for (int i =over_range+1; i < ranges; i++)
-    line[i].y_intercept += increasing;
-
-  last_y = last*line[ranges-1].gradient+line[ranges-1].y_intercept;
-  if (seg_num < PRACTICAL_MAX_SEG_NUM) {
-    int new_seg_num = last_y/limit_stride;
-    if (last_y % limit_stride != 0)
-      new_seg_num += 1;
-    return new_seg_num;
-  }
+  shift_ranges(over_range, needed_bucket * limit_stride);
 
+  last_y = line[ranges-1].end;
+  int new_seg_num = last_y/limit_stride;
+  if (last_y % limit_stride != 0)
+    new_seg_num += 1;
+  return new_seg_num;
 }
 
 
-inline size_t Directory::lcdf(int local_depth, size_t key) {
+template <typename K, typename V, size_t kNumSlot>
+inline size_t Directory<K, V, kNumSlot>::lcdf(int local_depth, size_t key) {
   if (line == NULL) {
     return seg_num * key;
   }
-  int target_range = key >> (64-kDepth-local_depth-range_bits);
-  return line[target_range].gradient*key + line[target_range].y_intercept;
+  int shift = kKeyBits - kDepth - local_depth - range_bits;
+  int target_range = key >> shift;
+  uint64_t start = range_start(target_range);
+  uint64_t offset = key & (((uint64_t)1 << shift) - 1);
+  // exact: the product of the range width and offset may pass 64 bits
+  return start + (uint64_t)(((unsigned __int128)(line[target_range].end - start)
+                             * offset) >> shift);
 }
 
 
-inline int Directory::divide_ranges_if_needed (uint64_t masked_key_hash, int local_depth) {
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::divide_ranges_if_needed(uint64_t masked_key_hash,
+    int local_depth, Context& ctx) {
   double util = 0;
   int changed = 0;
   int ranges = (1 << range_bits);
@@ -1170,32 +1475,26 @@ inline int Directory::divide_ranges_if_needed (uint64_t masked_key_hash, int loc
     changed = INITIAL_RANGE_BITS - range_bits;
     int stride = (1 << changed);
     LineFriends* new_line;
-    int new_ranges = (1 << INITIAL_RANGE_BITS);
-    if (INITIAL_RANGE_BITS <= 10) {
-      new_line = static_cast<LineFriends*>(line_alloc[INITIAL_RANGE_BITS-1].malloc());
-    }
-    else
-      new_line = new LineFriends[new_ranges];
+    new_line = ctx.line_malloc(INITIAL_RANGE_BITS);
     for (int i = ranges-1; i >= 0; i--) {
-      for (int j = 0; j < stride; j++) {
-        new_line[stride*i+j].gradient = line[i].gradient;
-        new_line[stride*i+j].y_intercept = line[i].y_intercept;
-      }
+      uint64_t start = range_start(i);
+      for (int j = 0; j < stride; j++)
+        new_line[stride*i+j].end = start + (line[i].end - start) * (j+1) / stride;
     }
-    delete[] line;
+    ctx.retire_line(line, range_bits);
     line = new_line;
     range_bits = INITIAL_RANGE_BITS;
     reclaim_flag *= stride;
   }
   do {
     int ranges = (1 << range_bits);
-    uint64_t limit_stride = ((size_t)1 << (64-kDepth-local_depth));
+    uint64_t limit_stride = ((size_t)1 << (kKeyBits - kDepth-local_depth));
     uint64_t  one_range = limit_stride / ranges;
     int range = get_local_cdf_range(masked_key_hash, local_depth);
     uint64_t first_key = lcdf(local_depth, (range*one_range));
-    int first_bucket = first_key >> (64 - kDepth - local_depth);
+    int first_bucket = first_key >> (kKeyBits - kDepth - local_depth);
     uint64_t last_key = lcdf(local_depth, ((range+1)*one_range-1));
-    int last_bucket  = last_key >> (64 - kDepth - local_depth);
+    int last_bucket  = last_key >> (kKeyBits - kDepth - local_depth);
     if (last_bucket == seg_num)
      last_bucket--;
     int count = 0;
@@ -1215,27 +1514,19 @@ inline int Directory::divide_ranges_if_needed (uint64_t masked_key_hash, int loc
     }
     util = (double)count / ((last_bucket - first_bucket + 1) * block);
     if (util < RECLAIM_THRE) {
-      if (range_bits == RANGE_BITS_LIMIT) {// [TODO] what is best value??
+      if (range_bits >= std::min(RANGE_BITS_LIMIT, (int)(kKeyBits - kDepth - local_depth))) {// [TODO] what is best value??
         break;
       }
       changed++;
       LineFriends* new_line;
-      if ((range_bits+1) <= 10) {
-        new_line = static_cast<LineFriends*>(line_alloc[range_bits].malloc());
-      }
-      else
-        new_line = new LineFriends[2*ranges]; // 2 * line
+      new_line = ctx.line_malloc(range_bits+1);
 
       for (int i = ranges-1; i >= 0; i--) {
-        new_line[2*i].gradient = line[i].gradient;
-        new_line[2*i].y_intercept = line[i].y_intercept;
-        new_line[2*i+1].gradient = line[i].gradient;
-        new_line[2*i+1].y_intercept = line[i].y_intercept;
+        uint64_t start = range_start(i);
+        new_line[2*i].end = start + (line[i].end - start) / 2;
+        new_line[2*i+1].end = line[i].end;
       }
-      if (range_bits <= 10)
-        line_alloc[range_bits-1].free(line);
-      else
-        delete[] line;
+      ctx.retire_line(line, range_bits);
       line = new_line;
       range_bits++;
       reclaim_flag *= 2;
@@ -1248,32 +1539,33 @@ inline int Directory::divide_ranges_if_needed (uint64_t masked_key_hash, int loc
 }
 
 
-inline void Directory::init_lcdf (int local_depth) {
+template <typename K, typename V, size_t kNumSlot>
+inline void Directory<K, V, kNumSlot>::init_lcdf(int local_depth, Context& ctx) {
   assert (line == NULL);
   remap_available = seg_num;
   range_bits = 1;
   int ranges = (1 << range_bits);
-  double gradient = seg_num;
-  line = static_cast<LineFriends*>(line_alloc[0].malloc());
-  for (int i = 0; i < ranges; i++) {
-    line[i].gradient = gradient;
-    line[i].y_intercept = 0;
-  }
+  uint64_t one_range = ((uint64_t)1 << (kKeyBits - kDepth - local_depth)) >> range_bits;
+  line = ctx.line_malloc(range_bits);
+  for (int i = 0; i < ranges; i++)
+    line[i].end = seg_num * one_range * (i+1);
 }
 
 
-inline double Directory::get_segment_util() {
+template <typename K, typename V, size_t kNumSlot>
+inline double Directory<K, V, kNumSlot>::get_segment_util() {
 
   return num_key/(double)(seg_num*kNumSlot);
 }
 
 // find over range from over bucket
-inline int Directory::find_over_range(int z, int local_depth, Key_t* over_bucket) {
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::find_over_range(int z, int local_depth, Key_t* over_bucket) {
   int prev_range;
   int prev_count = 0;
   int count = 0;
   int over_range;
-  size_t local_mask = ((size_t)1 << (8*sizeof(Key_t)-kDepth-local_depth))-1;
+  size_t local_mask = ((size_t)1 << (kKeyBits-kDepth-local_depth))-1;
   for (int k = z*block; k < (z+1)*block; k++) {
 #ifdef SEP
     uint64_t tkey_hash = key_slot[k].item & y_mask;
@@ -1296,12 +1588,13 @@ inline int Directory::find_over_range(int z, int local_depth, Key_t* over_bucket
   return over_range;
 }
 // find over range from over bucket
-inline int Directory::find_over_range(int z, int local_depth) {
+template <typename K, typename V, size_t kNumSlot>
+inline int Directory<K, V, kNumSlot>::find_over_range(int z, int local_depth) {
   int prev_range;
   int prev_count = 0;
   int count = 0;
   int over_range;
-  size_t local_mask = ((size_t)1 << (8*sizeof(Key_t)-kDepth-local_depth))-1;
+  size_t local_mask = ((size_t)1 << (kKeyBits-kDepth-local_depth))-1;
   for (int k = z*block; k < (z+1)*block; k++) {
 #ifdef SEP
     uint64_t tkey_hash = key_slot[k].item & y_mask;
@@ -1322,3 +1615,118 @@ inline int Directory::find_over_range(int z, int local_depth) {
   }
   return over_range;
 }
+
+// for snapshot
+// image of the segment, its slots and local cdf are placed at data_pos
+template <typename K, typename V, size_t kNumSlot>
+inline typename Directory<K, V, kNumSlot>::Image
+Directory<K, V, kNumSlot>::image(size_t local_depth, uint64_t& data_pos) {
+  Image img = {seg_num, remap_available, reclaim_flag, range_bits, num_key,
+               (uint32_t)local_depth, line != NULL, 0, 0};
+  data_pos = (data_pos + kImageAlign - 1) & ~(kImageAlign - 1);
+  img.chunk_offset = data_pos;
+  data_pos += chunk_size(seg_num);
+  if (line != NULL) {
+    data_pos = (data_pos + kImageAlign - 1) & ~(kImageAlign - 1);
+    img.line_offset = data_pos;
+    data_pos += sizeof(LineFriends) << range_bits;
+  }
+  return img;
+}
+
+// write slots and local cdf where image() placed them, pos is the offset
+// in the data section
+template <typename K, typename V, size_t kNumSlot>
+inline bool Directory<K, V, kNumSlot>::save_data(const Image& img, FILE* fp,
+                                                 uint64_t& pos) {
+  static const char zero[kImageAlign] = {};
+#ifdef SEP
+  void* chunk = key_slot;
+#else
+  void* chunk = slot;
+#endif
+  if (fwrite(zero, 1, img.chunk_offset - pos, fp) != img.chunk_offset - pos
+      || fwrite(chunk, chunk_size(seg_num), 1, fp) != 1)
+    return false;
+  pos = img.chunk_offset + chunk_size(seg_num);
+  if (line != NULL) {
+    if (fwrite(zero, 1, img.line_offset - pos, fp) != img.line_offset - pos
+        || fwrite(line, sizeof(LineFriends) << range_bits, 1, fp) != 1)
+      return false;
+    pos = img.line_offset + (sizeof(LineFriends) << range_bits);
+  }
+  return true;
+}
+
+// image within a data section of data_size bytes
+template <typename K, typename V, size_t kNumSlot>
+inline bool Directory<K, V, kNumSlot>::valid(const Image& img,
+                                             uint64_t data_size) {
+  // split_local_cdf gives at most twice max_bucket_num under UNIFORM_MAX_BITS
+  uint64_t max_seg_num = (uint64_t)2 << (UNIFORM_MAX_BITS
+      + std::max<int>((int)img.local_depth - REMAP_THRE, 0));
+  if (img.seg_num == 0 || img.seg_num > max_seg_num
+      || img.local_depth >= ((uint32_t)1 << LOCAL_DEPTH_BITS)
+      || img.range_bits < 0 || img.range_bits > RANGE_BITS_LIMIT
+      || (img.has_line && img.range_bits == 0)
+      || img.chunk_offset % kImageAlign != 0
+      || img.chunk_offset > data_size
+      || chunk_size(img.seg_num) > data_size - img.chunk_offset)
+    return false;
+  if (img.has_line
+      && (img.line_offset % kImageAlign != 0 || img.line_offset > data_size
+          || (sizeof(LineFriends) << img.range_bits) > data_size - img.line_offset))
+    return false;
+  return true;
+}
+
+// copy of the segment read from fp at data offset pos, NULL on a short read
+template <typename K, typename V, size_t kNumSlot>
+inline Directory<K, V, kNumSlot>* Directory<K, V, kNumSlot>::Load(
+    const Image& img, FILE* fp, uint64_t& pos, Context& ctx) {
+  char pad[kImageAlign];
+  Directory* seg = ctx.new_segment(img.local_depth, img.seg_num);
+#ifdef SEP
+  void* chunk = seg->key_slot;
+#else
+  void* chunk = seg->slot;
+#endif
+  if (img.chunk_offset < pos || img.chunk_offset - pos >= kImageAlign
+      || fread(pad, 1, img.chunk_offset - pos, fp) != img.chunk_offset - pos
+      || fread(chunk, chunk_size(img.seg_num), 1, fp) != 1) {
+    ctx.free_segment(seg);
+    return NULL;
+  }
+  pos = img.chunk_offset + chunk_size(img.seg_num);
+  seg->remap_available = img.remap_available;
+  seg->reclaim_flag = img.reclaim_flag;
+  seg->num_key = img.num_key;
+  if (img.has_line) {
+    seg->range_bits = img.range_bits;
+    seg->line = ctx.line_malloc(img.range_bits);
+    if (img.line_offset < pos || img.line_offset - pos >= kImageAlign
+        || fread(pad, 1, img.line_offset - pos, fp) != img.line_offset - pos
+        || fread(seg->line, sizeof(LineFriends) << img.range_bits, 1, fp) != 1) {
+      ctx.free_segment(seg);
+      return NULL;
+    }
+    pos = img.line_offset + (sizeof(LineFriends) << img.range_bits);
+  }
+  return seg;
+}
+
+// segment over slots and local cdf in a mapped data section. they are
+// copied on write by the mapping and replaced by pool memory on restructure.
+template <typename K, typename V, size_t kNumSlot>
+inline Directory<K, V, kNumSlot>* Directory<K, V, kNumSlot>::Map(
+    const Image& img, char* data, Context& ctx) {
+  Directory* seg = ctx.adopt_segment(data + img.chunk_offset, img.seg_num);
+  seg->remap_available = img.remap_available;
+  seg->reclaim_flag = img.reclaim_flag;
+  seg->num_key = img.num_key;
+  if (img.has_line) {
+    seg->range_bits = img.range_bits;
+    seg->line = (LineFriends*)(data + img.line_offset);
+  }
+  return seg;
+}
@@ -18,32 +18,334 @@ limitations under the License.
 #include <stdio.h>
 
 #include <cstring>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <atomic>
+#include <functional>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "util/pair.h"
 #include "util/util.h"
 #include "src/Directory.h"
 #include "src/ExtendibleHash.h"
-#include "util/pair.h"
+#include "util/wal.h"
+
+
+constexpr size_t kCapacity = (1 << kDepth);
+const size_t kMultiGetGroup = 16; // keys whose lookups are interleaved
+const size_t kParallelInsertWindow = 1 << 20; // pairs per round before the uniform test
+const size_t kParallelScanMin = 1 << 16; // keys in range before scanning on workers
+const size_t kLogStripes = 64; // locks ordering log and index per key (-DCONCURRENT)
+const size_t kMaintenanceQueue = 1 << 14; // segments waiting for the maintenance thread (-DCONCURRENT)
+const uint64_t kSnapshotMagic = 0x5354504e53544444; // "DDTSNPTS"
+const uint32_t kSnapshotVersion = 6;
+const uint64_t kSnapshotPage = 4096; // alignment of the data section
+
+// first bytes of a snapshot, the layout must match the loading index.
+// the metadata section follows: per used EH, x, global depth and max bits
+// (0 if not decided yet) as three uint32_t and a Directory::Image per segment
+// in hash order, then from outlier_meta_offset on outlier_levels outlier
+// indexes, each a SnapshotLevel and its EHs, the outliers of an index right
+// after it. the data section holds slots and local cdf at the offsets given
+// by the images, so the file can be mapped as is (DyTIS::MapSnapshot).
+struct SnapshotHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t num_slot;
+  uint32_t sep;
+  uint32_t buc_meta;
+  uint32_t depth;
+  int32_t max_bits;
+  uint32_t uniform_tested;
+  uint32_t num_EH;
+  uint64_t meta_size;
+  uint64_t data_offset;
+  uint64_t data_size;
+  uint64_t window_base;
+  int32_t window_shift;
+  uint32_t window_chosen;
+  uint64_t outlier_meta_offset;
+  uint32_t outlier_levels;
+  uint32_t padding;
+};
+
+// an outlier index in the metadata section, meta_size bytes of its EHs follow
+struct SnapshotLevel {
+  uint64_t window_base;
+  int32_t window_shift;
+  uint32_t window_chosen;
+  int32_t max_bits;
+  uint32_t uniform_tested;
+  uint32_t num_EH;
+  uint32_t padding;
+  uint64_t meta_size;
+};
+
+// bytes held by an index and its outlier indexes, see DyTIS::MemoryUsage
+struct IndexMemory {
+  size_t top_level = 0;   // DyTIS objects, EH arrays and their bitmaps
+  size_t directories = 0; // ExtendibleHash objects and their segment arrays
+  size_t segments = 0;    // Directory headers and their parked pairs
+  size_t used_slots = 0;  // slots holding a key
+  size_t empty_slots = 0; // free slots and bucket meta of the slot arrays
+  size_t cdf_models = 0;  // local cdf
+  size_t pool_cached = 0; // free chunks kept by the pools
+
+  size_t total(void) const {
+    return top_level + directories + segments + used_slots + empty_slots
+           + cdf_models + pool_cached;
+  }
+};
+
+// shape and local cdf state of one EH or of a set of them, see
+// DyTIS::Stats. histograms are indexed by the value counted
+struct ShapeStats {
+  std::vector<size_t> global_depth; // EHs by global depth
+  std::vector<size_t> local_depth;  // segments by local depth
+  std::vector<size_t> seg_num;      // segments by buckets
+  std::vector<size_t> util;         // segments by utilization in tenths
+  std::vector<size_t> range_bits;   // segments with a local cdf by range_bits
+  size_t segments = 0;
+  size_t keys = 0;
+  size_t slots = 0;
+  size_t lines = 0;          // segments with a local cdf
+  size_t expanded = 0;       // segments of several buckets without local cdf
+  size_t remap_ready = 0;    // remap_available > 0, may remap
+  size_t remap_exhausted = 0; // remap_available == 0, expands or splits
+  size_t remap_failed = 0;   // remap_available == -1, splits
+  size_t reclaimed = 0;      // segments with reclaim_flag > 0
+  size_t uniform = 0;        // EHs expanding up to UNIFORM_MAX_BITS
 
+  static void count(std::vector<size_t>& histogram, size_t i, size_t n = 1) {
+    if (histogram.size() <= i)
+      histogram.resize(i + 1, 0);
+    histogram[i] += n;
+  }
 
-const size_t kCapacity = (1 << kDepth);
-typedef class DyTIS DyTIS;
+  void add(const ShapeStats& other) {
+    auto merge = [](std::vector<size_t>& to, const std::vector<size_t>& from) {
+      for (size_t i = 0; i < from.size(); i++)
+        if (from[i] > 0)
+          count(to, i, from[i]);
+    };
+    merge(global_depth, other.global_depth);
+    merge(local_depth, other.local_depth);
+    merge(seg_num, other.seg_num);
+    merge(util, other.util);
+    merge(range_bits, other.range_bits);
+    segments += other.segments;
+    keys += other.keys;
+    slots += other.slots;
+    lines += other.lines;
+    expanded += other.expanded;
+    remap_ready += other.remap_ready;
+    remap_exhausted += other.remap_exhausted;
+    remap_failed += other.remap_failed;
+    reclaimed += other.reclaimed;
+    uniform += other.uniform;
+  }
+};
+
+// shape of an index and its outlier indexes, see DyTIS::Stats
+struct IndexStats {
+  ShapeStats total;           // EHs of all indexes
+  std::vector<ShapeStats> EH; // EH[x] of the index, empty if not in use
+  ShapeStats outliers;        // EHs of the outlier indexes
+  uint64_t reclaims = 0;      // remaps that took buckets from other ranges
+  int max_bits = 0;           // of the EHs not decided yet
+};
 
+template <typename K, typename V, size_t kNumSlot> class ShardedDyTIS;
+
+// e.g. DyTIS<uint32_t, uint64_t> for 32-bit keys with 8-byte values
+template <typename K = Key_t, typename V = Value_t,
+          size_t kNumSlot = kNumSlotDefault>
 class DyTIS {
+  public:
+    typedef Directory<K, V, kNumSlot> Directory_t;
+    typedef ExtendibleHash<K, V, kNumSlot> ExtendibleHash_t;
+    typedef K Key_t;
+    typedef V Value_t;
+    typedef KVPair<K, V> Pair;
+    static constexpr Key_t INVALID = Directory_t::INVALID;
+    static constexpr Value_t NONE = Directory_t::NONE;
+
   private:
-    ExtendibleHash** EH;
+    static constexpr int kKeyBits = Directory_t::kKeyBits;
+    static constexpr uint64_t y_mask = Directory_t::y_mask;
+    static constexpr int kBulkLoadMaxDepth =
+        std::min<int>(BULK_LOAD_MAX_DEPTH, kKeyBits - kDepth - 1);
+
+    ExtendibleHash_t** EH;
+    uint64_t* used; // bitmap of non-NULL EH[x]
+    IndexContext<K, V, kNumSlot> ctx; // pools and skew decision of this index
+    bool uniform_tested = false;
+#ifndef CONCURRENT
+    bool uniform_pending = false; // uniform_test deferred while ctx.parallel
+#endif
+    typedef WriteAheadLog<K, V> Log;
+    Log* wal = NULL; // OpenLog
+#ifdef CONCURRENT
+    // writes of a key reach the log and the index in the same order
+    std::mutex log_stripe[kLogStripes];
+    std::thread* maintainer = NULL; // StartMaintenance
+    std::atomic<bool> maintaining{false};
+#endif
+    friend class ShardedDyTIS<K, V, kNumSlot>;
+
+    // adaptive top level. keys whose top window_shift bits equal window_base
+    // are stored shifted left by window_shift, so EH[x] is picked by the bits
+    // right below the prefix they share. the others go to outliers, an index
+    // that chooses its own window. once keys move past the window (e.g.
+    // increasing keys), it is chosen again over both (rewindow).
+    Key_t window_base = 0;
+    Key_t window_mask = 0; // top window_shift bits
+    int window_shift = 0;
+    bool window_chosen = false; // by a load or by rewindow
+    DyTIS* outliers = NULL;
+    size_t window_keys = 0;  // inserted in the window since it was chosen
+    size_t outlier_keys = 0; // inserted in outliers since then
+
+    inline bool in_window(Key_t key) {
+      return (key & window_mask) == window_base;
+    }
+    inline Key_t to_internal(Key_t key) {
+      return (Key_t)(key << window_shift);
+    }
+    inline Key_t to_external(Key_t key) {
+      return (Key_t)(key >> window_shift) | window_base;
+    }
+    // EH of key, kCapacity for an outlier
+    inline size_t partition(Key_t key) {
+      if (!in_window(key))
+        return kCapacity;
+      return to_internal(key) >> (kKeyBits - kDepth);
+    }
+    inline DyTIS* outlier_index(void);
+
+    // EH[x] with its global depth hidden in the upper bits
+    inline uint64_t hidden_EH(size_t x) {
+      return (uint64_t)__atomic_load_n(&EH[x], __ATOMIC_ACQUIRE);
+    }
+
+    inline void mark_used(size_t x) {
+      __atomic_fetch_or(&used[x / 64], (uint64_t)1 << (x % 64),
+                        __ATOMIC_RELEASE);
+    }
+    inline size_t next_used(size_t);
+
+    template <typename F>
+    inline void for_each_segment(ExtendibleHash_t*, uint64_t, F&&);
+    inline void free_EH(ExtendibleHash_t*, uint64_t);
+    inline void clear(void);
+    inline void memory_usage(IndexMemory&);
+    inline void shape_stats(ExtendibleHash_t*, uint64_t, ShapeStats&);
+    inline int window_bits(Key_t, Key_t);
+    inline void set_window(Key_t, int);
+    inline bool rewindow(Key_t, Key_t);
+    inline bool valid_window(uint64_t, int32_t);
+    inline bool valid_header(const SnapshotHeader&, uint64_t);
+    template <typename F>
+    inline bool load_image(const SnapshotHeader&, const char*, F&&);
+    template <typename F>
+    inline bool load_images(const SnapshotHeader&, const char*, F&&);
+    inline void uniform_test(void);
+    inline void insert(Key_t&, Value_t);
+    inline void insert_internal(Key_t&, Value_t);
+    inline bool remove(Key_t&);
+    inline bool update(Key_t&, Value_t);
+    template <typename F> inline bool scan(Key_t, Key_t, F&&);
+    template <typename F> inline bool scan_internal(Key_t, Key_t, F&&);
+    inline void parallel_scan(Key_t, Key_t, std::vector<Pair>&, unsigned);
+    inline void bulk_load(const Pair*, size_t, int, std::vector<Directory_t*>&,
+                          std::vector<int>&, std::vector<Pair>&);
+    inline void parallel_insert(const Pair*, size_t, unsigned);
+#ifdef CONCURRENT
+    inline void maintain(void);
+    inline void drain_overflow(Key_t, Key_t);
+#endif
+    static inline void run_threads(unsigned, const std::function<void(unsigned)>&);
 
   public:
   DyTIS(void);
+  DyTIS(const DyTIS&) = delete;
+  DyTIS& operator=(const DyTIS&) = delete;
+  // no operation may be in flight
   ~DyTIS(void);
+  // without -DCONCURRENT, Insert chooses the key window of the top level from
+  // the stored keys when the uniform test is first due or an EH directory
+  // grows that deep, and again once outliers exceed 2^-WINDOW_OUTLIER_SHIFT
+  // of the keys in the window. that Insert stalls: it copies all n stored
+  // pairs aside, frees the index and bulk loads them again, O(n) time with
+  // the copy beside the index. since the outliers must grow first, it costs
+  // at most 2^WINDOW_OUTLIER_SHIFT + 1 pair copies per insert on average.
+  // -DCONCURRENT writers and ShardedDyTIS workers never choose the window,
+  // BulkLoad or LoadSnapshot the index first there.
   inline void Insert(Key_t&, Value_t);
+  // BulkLoad of an empty index chooses the key window from its keys, in every
+  // mode. ParallelInsert chooses it as Insert does, between its rounds
+  inline void BulkLoad(const Pair*, size_t);
+  // insert unsorted pairs on threads workers, each writing whole EHs.
+  // without -DCONCURRENT no other operation may run alongside
+  inline void ParallelInsert(const Pair*, size_t, unsigned);
+  // no writer may be in flight
+  inline bool SaveSnapshot(const char*);
+  // must be called before any other operation on the index
+  inline bool LoadSnapshot(const char*);
+  // as LoadSnapshot, but slots and local cdf stay in a private mapping of
+  // the file and are paged in on first use
+  inline bool MapSnapshot(const char*);
+  // replay the log at path, then log every Insert, Update and Delete.
+  // records are synced every sync_ops writes or sync_us microseconds
+  // (0: only by sync_ops and SyncLog). BulkLoad is not logged.
+  inline bool OpenLog(const char*, size_t, uint64_t);
+  inline bool SyncLog(void);
   inline bool Delete(Key_t&);
   inline Value_t Get(Key_t&);
+  inline void MultiGet(const Key_t*, size_t, Value_t*);
   inline Value_t* Scan(Key_t&, size_t);
+  inline size_t Scan(Key_t, size_t, Pair*);
+  template <typename F> inline void ScanRange(Key_t, Key_t, F&&);
+  // append the pairs in [lo, hi) to out in key order, return their number.
+  // ranges of kParallelScanMin keys or more are scanned on threads workers
+  inline size_t ParallelScanRange(Key_t, Key_t, std::vector<Pair>&, unsigned);
+  // not synchronized with writers even in the concurrent mode
   inline Value_t* Find(Key_t&);
   inline bool Update(Key_t&, Value_t);
+  // return cached pool memory (empty slabs, whole free pages of slot arrays)
+  // to the os, return its bytes. chunks retired by -DCONCURRENT writers come
+  // back to the pools once their readers leave
+  inline size_t ReleaseMemory(void);
+  // live and cached bytes of each size class of the pools: segments, slot
+  // arrays of 1 to pool_num buckets, local cdf of 2 to 2^line_pool_num ranges
+  inline void GetPoolUsage(std::vector<PoolUsage>&);
+  // walk every EH and segment, no writer may be in flight
+  inline IndexMemory MemoryUsage(void);
+  // SMOs run so far by this index and its outlier indexes, safe alongside
+  // writers
+  inline SMOStats GetSMOStats(void);
+  // walk every EH and segment, no writer may be in flight
+  inline IndexStats Stats(void);
+#ifdef CONCURRENT
+  // restructure full segments off the write path: Insert parks a pair that
+  // does not fit in its bucket in the segment (up to OVERFLOW_SIZE, inline
+  // as before beyond) and a background thread remaps, expands or splits the
+  // segment to move it in. outlier indexes restructure inline.
+  // no writer may be in flight
+  inline void StartMaintenance(void);
+  // stop the thread once every parked pair is moved in, no writer may be in
+  // flight
+  inline void StopMaintenance(void);
+#endif
 
 };
 
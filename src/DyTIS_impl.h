@@ -20,146 +20,1485 @@ limitations under the License.
 #include "src/ExtendibleHash_impl.h"
 
 
-DyTIS::DyTIS(void)
+template <typename K, typename V, size_t kNumSlot>
+DyTIS<K, V, kNumSlot>::DyTIS(void)
 {
-  EH = new ExtendibleHash*[kCapacity];
-  for (int i = 0; i < kCapacity; i++) {
+  EH = new ExtendibleHash_t*[kCapacity];
+  for (size_t i = 0; i < kCapacity; i++) {
     EH[i] = NULL;
   }
+  used = new uint64_t[(kCapacity + 63) / 64]();
 }
 
 
-DyTIS::~DyTIS(void)
+template <typename K, typename V, size_t kNumSlot>
+DyTIS<K, V, kNumSlot>::~DyTIS(void)
 {
+#ifdef CONCURRENT
+  StopMaintenance();
+#endif
+  delete wal;
+  delete outliers;
+#ifdef CONCURRENT
+  epoch::drain(&ctx);
+#endif
+  clear();
   delete[] EH;
+  delete[] used;
 }
 
-inline void DyTIS::Insert(Key_t& key, Value_t value) {
+// free every EH, no operation may be in flight
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::clear(void) {
+  for (size_t x = next_used(0); x < kCapacity; x = next_used(x + 1)) {
+    uint64_t hidden = hidden_EH(x);
+    if (hidden != 0)
+      free_EH((ExtendibleHash_t*)(hidden & ADDR_MASK), hidden >> ADDR_BITS);
+    EH[x] = NULL;
+  }
+  memset(used, 0, sizeof(uint64_t) * ((kCapacity + 63) / 64));
+  memset(ctx.part_bits, 0, sizeof(ctx.part_bits));
+  memset(ctx.samples, 0, sizeof(ctx.samples));
+}
+
+// created on first use, it chooses its window like any empty index
+template <typename K, typename V, size_t kNumSlot>
+inline DyTIS<K, V, kNumSlot>* DyTIS<K, V, kNumSlot>::outlier_index(void) {
+  DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+  if (index != NULL)
+    return index;
+  DyTIS* new_index = new DyTIS();
+  if (__atomic_compare_exchange_n(&outliers, &index, new_index, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return new_index;
+  delete new_index; // another thread created it first
+  return index;
+}
+
+// window_shift for keys in [lo, hi]. if they share WINDOW_MIN_SHARED_BITS
+// below the top level index, every EH directory would be indexed by those
+// constant bits first, so their prefix, WINDOW_SLACK_BITS shorter, becomes the
+// window. 0 if the whole key space stays the window.
+template <typename K, typename V, size_t kNumSlot>
+inline int DyTIS<K, V, kNumSlot>::window_bits(Key_t lo, Key_t hi) {
+  int common = (lo == hi) ? kKeyBits
+      : __builtin_clzll((uint64_t)(lo ^ hi)) - (64 - kKeyBits);
+  if (common < (int)kDepth + WINDOW_MIN_SHARED_BITS)
+    return 0;
+  return std::min(common - WINDOW_SLACK_BITS, kKeyBits - (int)kDepth);
+}
+
+// the index must be empty
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::set_window(Key_t key, int shift) {
+  window_chosen = true;
+  window_shift = shift;
+  window_mask = (shift == 0) ? 0 : (Key_t)(~(Key_t)0 << (kKeyBits - shift));
+  window_base = key & window_mask;
+}
+
+// choose the window from the keys stored so far, outliers included, and
+// [lo, hi], then bulk load the keys again with it. false if the window and
+// the index stay as they are.
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::rewindow(Key_t lo, Key_t hi) {
+  window_chosen = true;
+  // smallest key, then the largest from the last EH and outliers above it
+  bool empty = true;
+  scan(0, INVALID, [&](Key_t k, Value_t) {
+    lo = std::min(lo, k);
+    empty = false;
+    return false;
+  });
+  if (empty)
+    return false;
+  size_t last_x = kCapacity;
+  for (size_t x = next_used(0); x < kCapacity; x = next_used(x + 1))
+    last_x = x;
+  Key_t from = (last_x == kCapacity) ? 0
+      : to_external((Key_t)last_x << (kKeyBits - kDepth));
+  hi = std::max(hi, lo);
+  scan(from, INVALID, [&](Key_t k, Value_t) {
+    hi = std::max(hi, k);
+    return true;
+  });
+  int shift = window_bits(lo, hi);
+  Key_t mask = (shift == 0) ? 0 : (Key_t)(~(Key_t)0 << (kKeyBits - shift));
+  if (outliers == NULL && shift == window_shift && (lo & mask) == window_base)
+    return false;
+  std::vector<Pair> kv;
+  scan(0, INVALID, [&](Key_t k, Value_t v) {
+    kv.push_back(Pair(k, v));
+    return true;
+  });
+  delete outliers;
+  outliers = NULL;
+  clear();
+  set_window(lo, shift);
+  window_keys = 0;
+  outlier_keys = 0;
+  BulkLoad(kv.data(), kv.size());
+  return true;
+}
+
+// f(segment, local depth) for each segment of target_EH once, in hash order
+template <typename K, typename V, size_t kNumSlot>
+template <typename F>
+inline void DyTIS<K, V, kNumSlot>::for_each_segment(ExtendibleHash_t* target_EH,
+    uint64_t global_depth, F&& f) {
+  uint64_t capacity = (uint64_t)1 << global_depth;
+  uint64_t count = 0;
+  while (count < capacity) {
+    uint64_t entry = target_EH->load_seg(count);
+    uint64_t ld = entry >> (64 - LOCAL_DEPTH_BITS);
+    f((Directory_t*)(entry & ADDR_MASK), ld);
+    count += (uint64_t)1 << (global_depth - ld);
+  }
+}
+
+// EH with all of its segments
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::free_EH(ExtendibleHash_t* target_EH,
+                                           uint64_t global_depth) {
+  for_each_segment(target_EH, global_depth, [&](Directory_t* seg, uint64_t) {
+    ctx.free_segment(seg);
+  });
+  delete target_EH;
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::Insert(Key_t& key, Value_t value) {
+  if (wal == NULL) {
+    insert(key, value);
+    return;
+  }
+#ifdef CONCURRENT
+  std::lock_guard<std::mutex> guard(log_stripe[key % kLogStripes]);
+#endif
+  wal->append(Log::kInsert, key, value);
+  insert(key, value);
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::Delete(Key_t& key) {
+  if (wal == NULL)
+    return remove(key);
+#ifdef CONCURRENT
+  std::lock_guard<std::mutex> guard(log_stripe[key % kLogStripes]);
+#endif
+  wal->append(Log::kDelete, key, Value_t());
+  return remove(key);
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::Update(Key_t& key, Value_t value) {
+  if (wal == NULL)
+    return update(key, value);
+#ifdef CONCURRENT
+  std::lock_guard<std::mutex> guard(log_stripe[key % kLogStripes]);
+#endif
+  wal->append(Log::kUpdate, key, value);
+  return update(key, value);
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::OpenLog(const char* path, size_t sync_ops,
+                                           uint64_t sync_us) {
+  if (wal != NULL)
+    return false;
+  Log* log = new Log();
+  bool ok = log->open(path, sync_ops, sync_us,
+                      [&](const typename Log::Record& r) {
+    Key_t key = r.key;
+    if (r.op == Log::kInsert)
+      insert(key, r.value);
+    else if (r.op == Log::kUpdate)
+      update(key, r.value);
+    else
+      remove(key);
+  });
+  if (!ok) {
+    delete log;
+    return false;
+  }
+  wal = log;
+  return true;
+}
+
+// make every logged write durable now
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::SyncLog(void) {
+  return wal != NULL && wal->sync();
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::insert(Key_t& key, Value_t value) {
+  if (!in_window(key)) {
+    outlier_index()->insert(key, value);
+#ifndef CONCURRENT
+    // keys moved past the window, e.g. increasing ones
+    if (!ctx.parallel
+        && ++outlier_keys > (window_keys >> WINDOW_OUTLIER_SHIFT))
+      rewindow(INVALID, 0);
+#endif
+    return;
+  }
+#ifndef CONCURRENT
+  if (!ctx.parallel)
+    window_keys++;
+#endif
+  Key_t internal = to_internal(key);
+  insert_internal(internal, value);
+}
+
+// key is already shifted into the window
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::insert_internal(Key_t& key, Value_t value) {
   using namespace std;
+#ifdef CONCURRENT
+  epoch::EpochGuard guard;
+#endif
 
-  auto x = (key >> (8*sizeof(key) - kDepth));
+  auto x = (key >> (kKeyBits - kDepth));
   if (EH[x] == NULL) {
     int global_depth = 1;
     uint64_t capacity = (pow(2, global_depth));
-    EH[x] = new ExtendibleHash(global_depth);
-    for (int i = 0; i < capacity; ++i) {
-      EH[x]->seg[i] = new(seg_alloc.allocate(1))Directory(global_depth);
+    auto new_EH = new ExtendibleHash_t(global_depth);
+    for (uint64_t i = 0; i < capacity; ++i) {
+      new_EH->seg[i] = ctx.new_segment(global_depth);
       if (i > 0) {
-        Directory* prev_seg = (Directory*)((uint64_t)EH[x]->seg[i-1] & ADDR_MASK);
-        prev_seg->sibling = EH[x]->seg[i];
+        Directory_t* prev_seg = (Directory_t*)((uint64_t)new_EH->seg[i-1] & ADDR_MASK);
+        prev_seg->sibling = new_EH->seg[i];
       }
       uint64_t hidden_ld = \
                 (uint64_t) global_depth << LOCAL_DEPTH_SHIFT;
-      EH[x]->seg[i] += hidden_ld;
+      new_EH->seg[i] += hidden_ld;
     }
     uint64_t hidden_gd = (uint64_t) global_depth << ADDR_BITS;
-    EH[x] = (ExtendibleHash*)((uint64_t)EH[x] + hidden_gd);
+    new_EH = (ExtendibleHash_t*)((uint64_t)new_EH + hidden_gd);
+#ifdef CONCURRENT
+    if (!__sync_bool_compare_and_swap(&EH[x], NULL, new_EH)) {
+      // another thread created EH[x] first
+      auto temp_EH = (ExtendibleHash_t*)((uint64_t)new_EH & ADDR_MASK);
+      for (uint64_t i = 0; i < capacity; ++i)
+        ctx.free_segment((Directory_t*)((uint64_t)temp_EH->seg[i] & ADDR_MASK));
+      delete temp_EH;
+    }
+#else
+    EH[x] = new_EH;
+#endif
+    mark_used(x);
+  }
+
+RETRY:
+  uint64_t hidden = hidden_EH(x);
+  auto target_EH = (ExtendibleHash_t*)(hidden & ADDR_MASK);
+  auto global_depth = hidden >> ADDR_BITS;
+  int ret_global_depth = target_EH->Insert(key, value, global_depth, &EH[x], ctx);
+  if (ret_global_depth == -1) {
+#ifndef CONCURRENT
+    // the directory was doubled. keys sharing more bits than it can tell
+    // apart double it again and again, window them first
+    if (!window_chosen && !ctx.parallel
+        && (hidden_EH(x) >> ADDR_BITS) >= (REMAP_THRE+2)) {
+      Key_t external = to_external(key);
+      if (rewindow(external, external)) {
+        insert(external, value);
+        return;
+      }
+    }
+#endif
+    goto RETRY;
   }
+  global_depth = ret_global_depth;
 
-  auto target_EH = (ExtendibleHash*)((uint64_t)EH[x] & ADDR_MASK);
-  auto global_depth = (uint64_t)EH[x] >> ADDR_BITS;
-  auto seg = target_EH->seg;
-  int ret_global_depth = target_EH->Insert(key, value, global_depth);
-  if (global_depth != ret_global_depth) {
-    uint64_t hidden_gd = (uint64_t) (ret_global_depth - global_depth) << ADDR_BITS;
-    EH[x] = (ExtendibleHash*)((uint64_t)EH[x] + hidden_gd);
-    global_depth = ret_global_depth;
+#ifdef CONCURRENT
+  if (uniform_tested == false && global_depth >= (REMAP_THRE+2)
+      && __sync_bool_compare_and_swap(&uniform_tested, false, true)) {
+#else
+  if (uniform_tested == false && global_depth >= (REMAP_THRE+2)) {
+    if (ctx.parallel) { // other EHs are being written, ShardedDyTIS runs it
+      __atomic_store_n(&uniform_pending, true, __ATOMIC_RELAXED);
+      return;
+    }
+    // keys crowd into few EHs, spread them before judging the skew
+    if (!window_chosen && rewindow(INVALID, 0))
+      return;
+    uniform_tested = true;
+#endif
+    uniform_test();
   }
+}
+
+
+// uniformly distributed if more than 10% of segments were expanded without
+// local cdf, then segments may get more buckets before split. only the
+// default of the EHs, each EH then decides from its own full segments
+// (IndexContext::sample_full) and follows the drift of its keys
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::uniform_test(void) {
+  ShapeStats stats;
+  for (size_t x = next_used(0); x < kCapacity; x = next_used(x + 1)) {
+    uint64_t hidden = hidden_EH(x);
+    if (hidden != 0)
+      shape_stats((ExtendibleHash_t*)(hidden & ADDR_MASK), hidden >> ADDR_BITS,
+                  stats);
+  }
+  if ((double)stats.expanded/stats.segments > 0.1) {
+    __atomic_store_n(&ctx.max_bits, UNIFORM_MAX_BITS, __ATOMIC_RELAXED);
+  }
+}
+
+// build the index from pairs sorted by key without splits, remaps and
+// doubling. must be called before any other operation on the index.
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::BulkLoad(const Pair* kv, size_t n) {
+#ifdef CONCURRENT
+  epoch::EpochGuard guard;
+#endif
+  if (n == 0)
+    return;
+  if (!window_chosen && next_used(0) == kCapacity && outliers == NULL)
+    set_window(kv[0].key, window_bits(kv[0].key, kv[n-1].key));
+  window_chosen = true;
+  // keys of the window are contiguous in kv, the others are outliers
+  const Pair* first = std::lower_bound(kv, kv + n, window_base,
+      [](const Pair& p, Key_t k) { return p.key < k; });
+  const Pair* last = std::upper_bound(first, kv + n,
+      (Key_t)(window_base | ~window_mask),
+      [](Key_t k, const Pair& p) { return k < p.key; });
+  if (first != kv || last != kv + n) {
+    std::vector<Pair> out(kv, first);
+    out.insert(out.end(), last, kv + n);
+    outlier_index()->BulkLoad(out.data(), out.size());
+    outlier_keys += out.size();
+    kv = first;
+    n = last - first;
+  }
+  window_keys += n;
+
+  std::vector<Directory_t*> segs;
+  std::vector<int> depths;
+  std::vector<Pair> rest; // did not fit in their bucket, insert one by one
+  std::vector<Pair> shifted; // EH[x] part of kv with keys in the window
+  bool test = false;
+  size_t lo = 0;
+  while (lo < n) {
+    auto x = (to_internal(kv[lo].key) >> (kKeyBits - kDepth));
+    size_t hi = lo;
+    while (hi < n && (to_internal(kv[hi].key) >> (kKeyBits - kDepth)) == x)
+      hi++;
+    const Pair* part = kv + lo;
+    if (window_shift > 0) {
+      shifted.clear();
+      for (size_t i = lo; i < hi; i++)
+        shifted.push_back(Pair(to_internal(kv[i].key), kv[i].value));
+      part = shifted.data();
+    }
+    if (EH[x] != NULL) { // already in use, fall back to insert
+      rest.insert(rest.end(), part, part + (hi - lo));
+      lo = hi;
+      continue;
+    }
 
-  if (UNIFORM_TEST == false && global_depth >= (REMAP_THRE+2)) {
-    UNIFORM_TEST = true;
-    int seg_num=0;
-    int expand=0;
-    for (int i = 0; i < kCapacity; i++) {
-      if (EH[i] == NULL)
+    segs.clear();
+    depths.clear();
+    bulk_load(part, hi - lo, 0, segs, depths, rest);
+    int global_depth = *std::max_element(depths.begin(), depths.end());
+    auto new_EH = new ExtendibleHash_t(global_depth);
+    size_t y = 0;
+    for (size_t i = 0; i < segs.size(); i++) {
+      uint64_t chunk_size = (uint64_t)1 << (global_depth - depths[i]);
+      uint64_t hidden_ld = (uint64_t)depths[i] << LOCAL_DEPTH_SHIFT;
+      for (uint64_t j = 0; j < chunk_size; j++)
+        new_EH->seg[y++] = hidden_ld + segs[i];
+      if (i > 0)
+        segs[i-1]->sibling = segs[i];
+    }
+    uint64_t hidden_gd = (uint64_t)global_depth << ADDR_BITS;
+    mark_used(x);
+    __atomic_store_n(&EH[x], (ExtendibleHash_t*)((uint64_t)new_EH + hidden_gd),
+                     __ATOMIC_RELEASE);
+    if (global_depth >= (REMAP_THRE+2))
+      test = true;
+    lo = hi;
+  }
+
+  if (test && uniform_tested == false) {
+    uniform_tested = true;
+    uniform_test();
+  }
+  for (size_t i = 0; i < rest.size(); i++)
+    insert_internal(rest[i].key, rest[i].value);
+}
+
+// split kv[0..n) by hash prefix until each part fits in one segment
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::bulk_load(const Pair* kv, size_t n,
+    int local_depth, std::vector<Directory_t*>& segs, std::vector<int>& depths,
+    std::vector<Pair>& rest) {
+  if (local_depth > 0) {
+    Directory_t* seg = Directory_t::BulkLoad(kv, n, local_depth,
+        local_depth >= kBulkLoadMaxDepth, rest, ctx);
+    if (seg != NULL) {
+      segs.push_back(seg);
+      depths.push_back(local_depth);
+      return;
+    }
+  }
+  int split_bit = kKeyBits - kDepth - local_depth - 1;
+  auto mid = std::partition_point(kv, kv + n, [split_bit](const Pair& p) {
+    return ((p.key >> split_bit) & 1) == 0;
+  });
+  bulk_load(kv, mid - kv, local_depth + 1, segs, depths, rest);
+  bulk_load(mid, kv + n - mid, local_depth + 1, segs, depths, rest);
+}
+
+// f(t) for t in [0, threads), f(0) on the calling thread
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::run_threads(unsigned threads,
+    const std::function<void(unsigned)>& f) {
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; t++)
+    workers.emplace_back(f, t);
+  f(0);
+  for (auto& w : workers)
+    w.join();
+}
+
+// until the uniform test ran, pairs go in input order windows, so all EHs
+// have grown about as much as by Insert when it runs. pairs past the key
+// window would all go to the outlier index, written by one worker, so the
+// window is chosen over them first once they outgrow it as in Insert
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::ParallelInsert(const Pair* kv, size_t n,
+                                                  unsigned threads) {
+  threads = std::max(threads, 1u);
+#ifndef CONCURRENT
+  if (window_chosen) {
+    size_t out = 0;
+    Key_t out_lo = INVALID, out_hi = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (!in_window(kv[i].key)) {
+        out++;
+        out_lo = std::min(out_lo, kv[i].key);
+        out_hi = std::max(out_hi, kv[i].key);
+      }
+    }
+    if (out > 0 && outlier_keys + out
+                   > ((window_keys + n - out) >> WINDOW_OUTLIER_SHIFT))
+      rewindow(out_lo, out_hi);
+  }
+#endif
+  size_t lo = 0;
+  while (lo < n) {
+    size_t hi = uniform_tested ? n : std::min(n, lo + kParallelInsertWindow);
+    parallel_insert(kv + lo, hi - lo, threads);
+    lo = hi;
+  }
+}
+
+// radix-partition kv[0..n) by EH (outliers last), then insert the
+// partitions on threads workers, largest first. a partition is written by one worker only, in input
+// order. without -DCONCURRENT the uniform test cannot run while other EHs are
+// written, so the workers stop once it is pending, the test runs after the
+// join and the rest is inserted in a second round.
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::parallel_insert(const Pair* kv, size_t n,
+                                                   unsigned threads) {
+  size_t chunk = (n + threads - 1) / threads;
+
+  // count[t][x]: pairs of EH[x] in the t-th chunk, then where t writes them
+  std::vector<std::vector<size_t>> count(threads,
+                                         std::vector<size_t>(kCapacity + 1, 0));
+  run_threads(threads, [&](unsigned t) {
+    for (size_t i = t * chunk; i < std::min(n, (t + 1) * chunk); i++)
+      count[t][partition(kv[i].key)]++;
+  });
+  std::vector<size_t> start(kCapacity + 2, 0);
+  size_t offset = 0;
+  for (size_t x = 0; x <= kCapacity; x++) {
+    start[x] = offset;
+    for (unsigned t = 0; t < threads; t++) {
+      size_t c = count[t][x];
+      count[t][x] = offset;
+      offset += c;
+    }
+  }
+  start[kCapacity + 1] = offset;
+  std::vector<Pair> part(n);
+  run_threads(threads, [&](unsigned t) {
+    for (size_t i = t * chunk; i < std::min(n, (t + 1) * chunk); i++)
+      part[count[t][partition(kv[i].key)]++] = kv[i];
+  });
+
+  std::vector<size_t> order;
+  for (size_t x = 0; x <= kCapacity; x++)
+    if (start[x + 1] > start[x])
+      order.push_back(x);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return start[a + 1] - start[a] > start[b + 1] - start[b];
+  });
+  std::vector<size_t> done(start.begin(), start.end() - 1); // next pair of EH[x]
+
+#ifndef CONCURRENT
+  ctx.parallel = true;
+#endif
+  while (true) {
+    std::atomic<size_t> next{0};
+    run_threads(threads, [&](unsigned) {
+      for (size_t i = next++; i < order.size(); i = next++) {
+        size_t x = order[i];
+        for (; done[x] < start[x + 1]; done[x]++) {
+#ifndef CONCURRENT
+          if (__atomic_load_n(&uniform_pending, __ATOMIC_RELAXED))
+            return; // partitions from i on are resumed in the next round
+#endif
+          Insert(part[done[x]].key, part[done[x]].value);
+        }
+      }
+    });
+#ifdef CONCURRENT
+    break;
+#else
+    if (!uniform_pending)
+      break;
+    uniform_pending = false;
+    ctx.parallel = false;
+    if (!window_chosen) {
+      // the stored keys come from the largest partitions, the window must
+      // cover the rest too
+      std::vector<Pair> rest;
+      Key_t lo = INVALID, hi = 0;
+      for (size_t x = 0; x <= kCapacity; x++) {
+        for (size_t i = done[x]; i < start[x + 1]; i++) {
+          lo = std::min(lo, part[i].key);
+          hi = std::max(hi, part[i].key);
+        }
+        rest.insert(rest.end(), part.begin() + done[x],
+                    part.begin() + start[x + 1]);
+      }
+      if (rewindow(lo, hi)) { // the EHs were rebuilt, partition again
+        parallel_insert(rest.data(), rest.size(), threads);
+        return;
+      }
+    }
+    ctx.parallel = true;
+    uniform_tested = true;
+    uniform_test();
+    order.erase(std::remove_if(order.begin(), order.end(), [&](size_t x) {
+      return done[x] == start[x + 1];
+    }), order.end());
+#endif
+  }
+#ifndef CONCURRENT
+  ctx.parallel = false;
+  window_keys += start[kCapacity];
+  outlier_keys += start[kCapacity + 1] - start[kCapacity];
+#endif
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::SaveSnapshot(const char* path) {
+#ifdef CONCURRENT
+  epoch::EpochGuard guard;
+  if (ctx.deferred != NULL) // images hold the slots only
+    drain_overflow(0, INVALID);
+#endif
+  SnapshotHeader header = {kSnapshotMagic, kSnapshotVersion, sizeof(Key_t),
+      sizeof(Value_t), kNumSlot, 0, kBucMeta, kDepth, ctx.max_bits,
+      uniform_tested, 0, 0, 0, 0, window_base, window_shift, window_chosen,
+      0, 0, 0};
+#ifdef SEP
+  header.sep = 1;
+#endif
+  // metadata first, it places every segment in the data section. the
+  // outlier indexes follow this index.
+  std::vector<char> meta;
+  std::vector<std::pair<Directory_t*, size_t>> segs; // with its image in meta
+  auto append = [&](const void* p, size_t n) {
+    meta.insert(meta.end(), (const char*)p, (const char*)p + n);
+  };
+  auto save_EHs = [&](DyTIS* index) {
+    uint32_t num_EH = 0;
+    for (size_t x = index->next_used(0); x < kCapacity;
+         x = index->next_used(x + 1)) {
+      uint64_t hidden = index->hidden_EH(x);
+      if (hidden == 0)
         continue;
-      auto temp_EH = (ExtendibleHash*)((uint64_t)EH[i] & ADDR_MASK);
-      auto global_depth = (uint64_t)EH[i] >> ADDR_BITS;
-      uint64_t capacity = (pow(2, global_depth));
-      int count = 0;
-      while (count < capacity) {
-        auto target = (Directory*)((uint64_t)temp_EH->seg[count] & ADDR_MASK);
-        uint64_t ld = (uint64_t)temp_EH->seg[count] >> (64 - LOCAL_DEPTH_BITS);
-        int chunk_size = pow(2, global_depth - ld);
-        count += chunk_size;
-        seg_num++;
-        if (target->line == NULL && target->seg_num > 1)
-          expand++;
+      uint32_t eh_header[3] = {(uint32_t)x, (uint32_t)(hidden >> ADDR_BITS),
+                               (uint32_t)index->ctx.part_bits[x]};
+      append(eh_header, sizeof(eh_header));
+      num_EH++;
+      for_each_segment((ExtendibleHash_t*)(hidden & ADDR_MASK), eh_header[1],
+                       [&](Directory_t* seg, uint64_t ld) {
+        auto img = seg->image(ld, header.data_size);
+        segs.push_back({seg, meta.size()});
+        append(&img, sizeof(img));
+      });
+    }
+    return num_EH;
+  };
+  header.num_EH = save_EHs(this);
+  header.outlier_meta_offset = meta.size();
+  for (DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+       index != NULL;
+       index = __atomic_load_n(&index->outliers, __ATOMIC_ACQUIRE)) {
+    SnapshotLevel level = {index->window_base, index->window_shift,
+        index->window_chosen, index->ctx.max_bits, index->uniform_tested,
+        0, 0, 0};
+    size_t level_offset = meta.size();
+    append(&level, sizeof(level));
+    level.num_EH = save_EHs(index);
+    level.meta_size = meta.size() - level_offset - sizeof(level);
+    memcpy(meta.data() + level_offset, &level, sizeof(level));
+    header.outlier_levels++;
+  }
+  header.meta_size = meta.size();
+  header.data_offset = (sizeof(header) + meta.size() + kSnapshotPage - 1)
+                       & ~(kSnapshotPage - 1);
+
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL)
+    return false;
+  std::vector<char> pad(header.data_offset - sizeof(header) - meta.size());
+  bool ok = (fwrite(&header, sizeof(header), 1, fp) == 1)
+      && fwrite(meta.data(), 1, meta.size(), fp) == meta.size()
+      && fwrite(pad.data(), 1, pad.size(), fp) == pad.size();
+  uint64_t pos = 0;
+  for (size_t i = 0; ok && i < segs.size(); i++) {
+    typename Directory_t::Image img;
+    memcpy(&img, meta.data() + segs[i].second, sizeof(img));
+    ok = segs[i].first->save_data(img, fp, pos);
+  }
+  if (fclose(fp) != 0)
+    ok = false;
+  return ok;
+}
+
+// window of a snapshot, base holds the top shift bits only
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::valid_window(uint64_t base, int32_t shift) {
+  return shift >= 0 && shift <= kKeyBits - (int)kDepth
+      && (Key_t)base == base && (Key_t)(base << shift) == 0;
+}
+
+// header of a snapshot file of file_size bytes for this index
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::valid_header(const SnapshotHeader& header,
+                                                uint64_t file_size) {
+  return header.magic == kSnapshotMagic && header.version == kSnapshotVersion
+      && header.key_size == sizeof(Key_t) && header.value_size == sizeof(Value_t)
+      && header.num_slot == kNumSlot && header.buc_meta == kBucMeta
+#ifdef SEP
+      && header.sep == 1
+#else
+      && header.sep == 0
+#endif
+      && header.depth == kDepth && header.num_EH <= kCapacity
+      && header.max_bits >= SKEWED_MAX_BITS
+      && header.max_bits <= UNIFORM_MAX_BITS
+      && valid_window(header.window_base, header.window_shift)
+      && header.outlier_meta_offset <= header.meta_size
+      && header.data_offset % kSnapshotPage == 0
+      && header.data_offset <= file_size
+      && header.meta_size <= header.data_offset - sizeof(header)
+      && header.data_size <= file_size - header.data_offset;
+}
+
+// rebuild EH[], the seg arrays with their hidden depths and the sibling links
+// from the metadata section. segment(img, ctx) returns the segment of an image or
+// NULL. nothing is published unless every image is loaded.
+template <typename K, typename V, size_t kNumSlot>
+template <typename F>
+inline bool DyTIS<K, V, kNumSlot>::load_image(const SnapshotHeader& header,
+    const char* meta, F&& segment) {
+  typedef typename Directory_t::Image Image;
+  std::vector<std::pair<size_t, uint64_t>> loaded; // x, hidden EH
+  std::vector<Directory_t*> segs;
+  std::vector<uint32_t> lds; // local depths of segs
+  size_t off = 0;
+  bool ok = true;
+  for (uint32_t i = 0; ok && i < header.num_EH; i++) {
+    uint32_t eh_header[3];
+    if (header.meta_size - off < sizeof(eh_header)) {
+      ok = false;
+      break;
+    }
+    memcpy(eh_header, meta + off, sizeof(eh_header));
+    off += sizeof(eh_header);
+    if (eh_header[0] >= kCapacity || EH[eh_header[0]] != NULL
+        || eh_header[1] >= ((uint32_t)1 << LOCAL_DEPTH_BITS)
+        || eh_header[1] > (uint32_t)(kKeyBits - kDepth)
+        || (eh_header[2] != 0 && eh_header[2] != SKEWED_MAX_BITS
+            && eh_header[2] != UNIFORM_MAX_BITS)) {
+      ok = false;
+      break;
+    }
+    size_t x = eh_header[0];
+    uint32_t global_depth = eh_header[1];
+    uint64_t capacity = (uint64_t)1 << global_depth;
+    segs.clear();
+    lds.clear();
+    // the images must tile the directory and one of them must be as deep as
+    // it, check before allocating it
+    uint64_t count = 0;
+    uint32_t max_ld = 0;
+    while (count < capacity) {
+      Image img;
+      Directory_t* seg = NULL;
+      if (header.meta_size - off >= sizeof(img)) {
+        memcpy(&img, meta + off, sizeof(img));
+        off += sizeof(img);
+        if (img.local_depth <= global_depth
+            && count % ((uint64_t)1 << (global_depth - img.local_depth)) == 0
+            && Directory_t::valid(img, header.data_size))
+          seg = segment(img, ctx);
+      }
+      if (seg == NULL) {
+        ok = false;
+        break;
       }
+      if (!segs.empty())
+        segs.back()->sibling = seg;
+      segs.push_back(seg);
+      lds.push_back(img.local_depth);
+      max_ld = std::max(max_ld, img.local_depth);
+      count += (uint64_t)1 << (global_depth - img.local_depth);
+    }
+    if (ok && max_ld != global_depth)
+      ok = false;
+    if (!ok) {
+      for (auto seg : segs)
+        ctx.free_segment(seg);
+      break;
+    }
+    auto new_EH = new ExtendibleHash_t(global_depth);
+    count = 0;
+    for (size_t i = 0; i < segs.size(); i++) {
+      uint64_t hidden_ld = (uint64_t)lds[i] << LOCAL_DEPTH_SHIFT;
+      uint64_t chunk_size = (uint64_t)1 << (global_depth - lds[i]);
+      for (uint64_t j = 0; j < chunk_size; j++)
+        new_EH->seg[count++] = hidden_ld + segs[i];
+    }
+    EH[x] = new_EH; // reserve x against duplicates, published below
+    ctx.part_bits[x] = eh_header[2];
+    loaded.push_back({x, (uint64_t)global_depth << ADDR_BITS});
+  }
+
+  for (auto& l : loaded) {
+    auto new_EH = EH[l.first];
+    EH[l.first] = NULL;
+    if (!ok) {
+      ctx.part_bits[l.first] = 0;
+      free_EH(new_EH, l.second >> ADDR_BITS);
+      continue;
+    }
+    mark_used(l.first);
+    __atomic_store_n(&EH[l.first],
+                     (ExtendibleHash_t*)((uint64_t)new_EH + l.second),
+                     __ATOMIC_RELEASE);
+  }
+  if (ok) {
+    ctx.max_bits = header.max_bits;
+    uniform_tested = header.uniform_tested;
+  }
+  return ok;
+}
+
+// this index from the first outlier_meta_offset bytes of meta, then the
+// outlier indexes from the rest. on failure the index is left empty.
+template <typename K, typename V, size_t kNumSlot>
+template <typename F>
+inline bool DyTIS<K, V, kNumSlot>::load_images(const SnapshotHeader& header,
+    const char* meta, F&& segment) {
+  SnapshotHeader part = header;
+  part.meta_size = header.outlier_meta_offset;
+  if (!load_image(part, meta, segment))
+    return false;
+  DyTIS* index = this;
+  size_t off = header.outlier_meta_offset;
+  for (uint32_t i = 0; i < header.outlier_levels; i++) {
+    SnapshotLevel level;
+    bool ok = header.meta_size - off >= sizeof(level);
+    if (ok) {
+      memcpy(&level, meta + off, sizeof(level));
+      off += sizeof(level);
+      ok = valid_window(level.window_base, level.window_shift)
+          && level.num_EH <= kCapacity
+          && level.max_bits >= SKEWED_MAX_BITS
+          && level.max_bits <= UNIFORM_MAX_BITS
+          && level.meta_size <= header.meta_size - off;
     }
-    if ((double)expand/seg_num > 0.1) {
-      DEFAULT_MAX_BITS = UNIFORM_MAX_BITS;
+    if (ok) {
+      index = index->outlier_index();
+      index->ctx.mapped = ctx.mapped;
+      index->ctx.mapped_size = ctx.mapped_size;
+      index->ctx.unmap = false;
+      part.meta_size = level.meta_size;
+      part.num_EH = level.num_EH;
+      part.max_bits = level.max_bits;
+      part.uniform_tested = level.uniform_tested;
+      ok = index->load_image(part, meta + off, segment);
+      off += level.meta_size;
+      index->set_window(level.window_base, level.window_shift);
+      index->window_chosen = level.window_chosen;
+    }
+    if (!ok) {
+      delete outliers;
+      outliers = NULL;
+      clear();
+      return false;
     }
   }
+  set_window(header.window_base, header.window_shift);
+  window_chosen = header.window_chosen;
+  return true;
 }
 
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::LoadSnapshot(const char* path) {
+  if (next_used(0) != kCapacity || outliers != NULL) // not empty
+    return false;
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL)
+    return false;
+  setvbuf(fp, NULL, _IOFBF, 1 << 20);
+  struct stat st;
+  SnapshotHeader header;
+  std::vector<char> meta;
+  bool ok = fstat(fileno(fp), &st) == 0
+      && fread(&header, sizeof(header), 1, fp) == 1
+      && valid_header(header, st.st_size);
+  if (ok) {
+    meta.resize(header.meta_size);
+    ok = fread(meta.data(), 1, meta.size(), fp) == meta.size()
+         && fseeko(fp, header.data_offset, SEEK_SET) == 0;
+  }
+  uint64_t pos = 0; // in the data section, images are in file order
+  ok = ok && load_images(header, meta.data(), [&](const auto& img, auto& c) {
+    return Directory_t::Load(img, fp, pos, c);
+  });
+  fclose(fp);
+  return ok;
+}
 
-inline bool DyTIS::Delete(Key_t& key) {
-  auto x = (key >> (8*sizeof(key) - kDepth));
-  if (EH[x] == NULL) return true;
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::MapSnapshot(const char* path) {
+  if (next_used(0) != kCapacity || outliers != NULL || ctx.mapped != NULL)
+    return false;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void* addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SnapshotHeader))
+    addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  char* base = (char*)addr;
+  SnapshotHeader header;
+  memcpy(&header, base, sizeof(header));
+  bool ok = valid_header(header, st.st_size);
+  ctx.mapped = base;
+  ctx.mapped_size = st.st_size;
+  ok = ok && load_images(header, base + sizeof(header),
+                         [&](const auto& img, auto& c) {
+    return Directory_t::Map(img, base + header.data_offset, c);
+  });
+  if (!ok) {
+    munmap(base, st.st_size);
+    ctx.mapped = NULL;
+    ctx.mapped_size = 0;
+  }
+  return ok;
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::remove(Key_t& key) {
+#ifdef CONCURRENT
+  epoch::EpochGuard guard;
+#endif
+  if (!in_window(key)) {
+    DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+    return index == NULL || index->remove(key);
+  }
+  Key_t internal = to_internal(key);
+  auto x = (internal >> (kKeyBits - kDepth));
+RETRY:
+  uint64_t hidden = hidden_EH(x);
+  if (hidden == 0) return true;
 
-  auto target_EH = (ExtendibleHash*)((uint64_t)EH[x] & ADDR_MASK);
-  auto global_depth = (uint64_t)EH[x] >> ADDR_BITS;
-  return target_EH->Delete(key, global_depth);
+  auto target_EH = (ExtendibleHash_t*)(hidden & ADDR_MASK);
+  auto global_depth = hidden >> ADDR_BITS;
+  int ret = target_EH->Delete(internal, global_depth);
+  if (ret == -1)
+    goto RETRY;
+  return ret;
 }
 
-Value_t DyTIS::Get(Key_t& key) {
-  auto x = (key >> (8*sizeof(key) - kDepth));
-  if (EH[x] == NULL) return NONE;
+template <typename K, typename V, size_t kNumSlot>
+inline V DyTIS<K, V, kNumSlot>::Get(Key_t& key) {
+#ifdef CONCURRENT
+  epoch::EpochGuard guard;
+#endif
+  if (!in_window(key)) {
+    DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+    return index == NULL ? NONE : index->Get(key);
+  }
+  Key_t internal = to_internal(key);
+  auto x = (internal >> (kKeyBits - kDepth));
+  uint64_t hidden = hidden_EH(x);
+  if (hidden == 0) return NONE;
 
-  auto target_EH = (ExtendibleHash*)((uint64_t)EH[x] & ADDR_MASK);
-  auto global_depth = (uint64_t)EH[x] >> ADDR_BITS;
-  return target_EH->Get(key, global_depth);
+  auto target_EH = (ExtendibleHash_t*)(hidden & ADDR_MASK);
+  auto global_depth = hidden >> ADDR_BITS;
+  return target_EH->Get(internal, global_depth);
 }
 
+// Get for a batch of keys. Keys are processed in groups of kMultiGetGroup and
+// each stage of the lookup (EH -> seg[y] -> Directory_t -> line -> bucket) is
+// prefetched for the whole group before any key of the group reads it.
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::MultiGet(const Key_t* keys, size_t n, Value_t* out) {
+#ifdef CONCURRENT
+  epoch::EpochGuard guard;
+#endif
+  Key_t k[kMultiGetGroup]; // in the window, unused for outliers
+  ExtendibleHash_t* target_EH[kMultiGetGroup];
+  uint64_t global_depth[kMultiGetGroup];
+  size_t y[kMultiGetGroup];
+  Directory_t* target[kMultiGetGroup];
+  uint64_t local_depth[kMultiGetGroup];
+  size_t z[kMultiGetGroup];
+#ifdef CONCURRENT
+  uint64_t version[kMultiGetGroup];
+  bool restart[kMultiGetGroup];
+#endif
 
-inline Value_t* DyTIS::Scan(Key_t& key, size_t n) {
+  for (size_t base = 0; base < n; base += kMultiGetGroup) {
+    size_t num = std::min(kMultiGetGroup, n - base);
 
-  Value_t* result = new Value_t[n];
-  auto x = (key >> (8*sizeof(key) - kDepth));
-  int count = 0;
-  if (EH[x] != NULL) {
-    auto target_EH = (ExtendibleHash*)((uint64_t)EH[x] & ADDR_MASK);
-    auto global_depth = (uint64_t)EH[x] >> ADDR_BITS;
-    target_EH->Scan(key, count, n, result, global_depth);
-    if (count == n) {
-      return result;
-    }
-  }
-  Key_t k = 0; // only first EH need to compare key
-  while (x < kCapacity) {
-    if (EH[x] == NULL) {
+    for (size_t i = 0; i < num; i++) {
+      if (!in_window(keys[base+i])) {
+        target_EH[i] = NULL;
+        continue;
+      }
+      k[i] = to_internal(keys[base+i]);
+      uint64_t hidden = hidden_EH(k[i] >> (kKeyBits - kDepth));
+      target_EH[i] = (ExtendibleHash_t*)(hidden & ADDR_MASK);
+      global_depth[i] = hidden >> ADDR_BITS;
+      __builtin_prefetch(target_EH[i]);
+    }
+    for (size_t i = 0; i < num; i++) {
+      if (target_EH[i] == NULL)
+        continue;
+      y[i] = ((k[i] & y_mask) >> (kKeyBits - kDepth - global_depth[i]));
+      __builtin_prefetch(&target_EH[i]->seg[y[i]]);
+    }
+    for (size_t i = 0; i < num; i++) {
+      if (target_EH[i] == NULL)
+        continue;
+      uint64_t entry = target_EH[i]->load_seg(y[i]);
+      target[i] = (Directory_t*)(entry & ADDR_MASK);
+      local_depth[i] = entry >> (64 - LOCAL_DEPTH_BITS);
+      __builtin_prefetch(target[i]);
+    }
+    for (size_t i = 0; i < num; i++) {
+      if (target_EH[i] == NULL)
+        continue;
+#ifdef CONCURRENT
+      restart[i] = false;
+      version[i] = target[i]->lock.read_begin(restart[i]);
+      if (restart[i])
+        continue;
+#endif
+      if (target[i]->line != NULL) {
+        size_t local_mask = ((size_t)1 << (kKeyBits - kDepth - local_depth[i])) - 1;
+        int range = ((k[i] & y_mask & local_mask) >>
+                     (kKeyBits - kDepth - local_depth[i] - target[i]->range_bits));
+        __builtin_prefetch(&target[i]->line[range]);
+      }
+    }
+    for (size_t i = 0; i < num; i++) {
+      if (target_EH[i] == NULL)
+        continue;
+#ifdef CONCURRENT
+      if (restart[i])
+        continue;
+#endif
+      size_t local_mask = ((size_t)1 << (kKeyBits - kDepth - local_depth[i])) - 1;
+      size_t local_key_hash = target[i]->lcdf(local_depth[i], k[i] & y_mask & local_mask);
+      z[i] = (local_key_hash >> (kKeyBits - kDepth - local_depth[i]));
+      target[i]->prefetch_bucket(z[i]);
+    }
+    for (size_t i = 0; i < num; i++) {
+      Key_t key = keys[base+i];
+      if (target_EH[i] == NULL) {
+        out[base+i] = in_window(key) ? NONE : Get(key);
+        continue;
+      }
+#ifdef CONCURRENT
+      if (!restart[i]) {
+        out[base+i] = target[i]->Get(k[i], z[i]);
+        if (target[i]->lock.validate(version[i]))
+          continue;
+      }
+      // changed by a writer while the group was in flight
+      out[base+i] = Get(key);
+#else
+      out[base+i] = target[i]->Get(k[i], z[i]);
+#endif
+    }
+  }
+}
+
+
+// first x' >= x with non-NULL EH[x'], kCapacity if none
+template <typename K, typename V, size_t kNumSlot>
+inline size_t DyTIS<K, V, kNumSlot>::next_used(size_t x) {
+  for (size_t w = x / 64; w < (kCapacity + 63) / 64; w++) {
+    uint64_t bits = __atomic_load_n(&used[w], __ATOMIC_ACQUIRE);
+    if (w == x / 64)
+      bits &= ~(uint64_t)0 << (x % 64);
+    if (bits != 0)
+      return std::min(w * 64 + __builtin_ctzll(bits), kCapacity);
+  }
+  return kCapacity;
+}
+
+// visit pairs with key in [key, end_key) in key order until f returns false.
+// false if f stopped the scan.
+template <typename K, typename V, size_t kNumSlot>
+template <typename F>
+inline bool DyTIS<K, V, kNumSlot>::scan(Key_t key, Key_t end_key, F&& f) {
+#ifdef CONCURRENT
+  epoch::EpochGuard guard;
+#endif
+  if (key >= end_key)
+    return true;
+  DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+  Key_t last = window_base | ~window_mask; // of the window
+  if (key < window_base && index != NULL
+      && !index->scan(key, std::min(end_key, window_base), f))
+    return false;
+  if (end_key > window_base && key <= last) {
+    Key_t lo = to_internal(std::max(key, window_base));
+    Key_t hi = (end_key > last) ? INVALID : to_internal(end_key);
+    if (!scan_internal(lo, hi, f))
+      return false;
+  }
+  if (last != INVALID && end_key > last + 1 && index != NULL)
+    return index->scan(std::max(key, (Key_t)(last + 1)), end_key, f);
+  return true;
+}
+
+// scan of [key, end_key) in the window, both shifted into it
+template <typename K, typename V, size_t kNumSlot>
+template <typename F>
+inline bool DyTIS<K, V, kNumSlot>::scan_internal(Key_t key, Key_t end_key,
+                                                 F&& f) {
+  if (key >= end_key)
+    return true;
+  const int shift = kKeyBits - kDepth;
+  Key_t last = 0;
+  bool visited = false;
+  bool stopped = false; // by f, not by end_key
+  auto visit = [&](Key_t k, Value_t v) {
+    last = k;
+    visited = true;
+    stopped = !f(to_external(k), v);
+    return !stopped;
+  };
+  size_t x = (key >> shift);
+  size_t last_x = ((end_key - 1) >> shift);
+  while ((x = next_used(x)) <= last_x) {
+    if (x != (key >> shift))
+      key = (Key_t)x << shift; // other EHs are scanned from the first key
+    uint64_t hidden = hidden_EH(x);
+    if (hidden == 0) { // marked, but not published yet
       x++;
       continue;
     }
-    auto target_EH = (ExtendibleHash*)((uint64_t)EH[x] & ADDR_MASK);
-    auto global_depth = (uint64_t)EH[x] >> ADDR_BITS;
-    target_EH->Scan(k, count, n, result, global_depth);
-    if (count == n) {
-      return result;
+    auto target_EH = (ExtendibleHash_t*)(hidden & ADDR_MASK);
+    auto global_depth = hidden >> ADDR_BITS;
+    int ret = target_EH->Scan(key, end_key, global_depth, visit);
+    if (ret == 0)
+      return !stopped;
+    if (ret == -1) { // resume after the last visited key
+      if (visited) {
+        key = last + 1;
+        x = (key >> shift);
+      }
+      continue;
     }
     x++;
   }
+  return true;
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline V* DyTIS<K, V, kNumSlot>::Scan(Key_t& key, size_t n) {
+  Value_t* result = new Value_t[n];
+  size_t count = 0;
+  if (n == 0)
+    return result;
+  scan(key, INVALID, [&](Key_t k, Value_t v) {
+    result[count++] = v;
+    return count < n;
+  });
   return result;
 }
 
-inline Value_t* DyTIS::Find(Key_t& key) {
+// no allocation, return the number of pairs written to out
+template <typename K, typename V, size_t kNumSlot>
+inline size_t DyTIS<K, V, kNumSlot>::Scan(Key_t key, size_t n, Pair* out) {
+  size_t count = 0;
+  if (n == 0)
+    return 0;
+  scan(key, INVALID, [&](Key_t k, Value_t v) {
+    out[count].key = k;
+    out[count++].value = v;
+    return count < n;
+  });
+  return count;
+}
 
-  auto x = (key >> (8*sizeof(key) - kDepth));
-  if (EH[x] == NULL) return NULL;
+// call f(key, value) for every key in [lo, hi) in key order. the scan stops at
+// the first key >= hi and skips unused EH without touching them.
+// if f returns bool, false stops the scan.
+template <typename K, typename V, size_t kNumSlot>
+template <typename F>
+inline void DyTIS<K, V, kNumSlot>::ScanRange(Key_t lo, Key_t hi, F&& f) {
+  scan(lo, hi, [&](Key_t k, Value_t v) {
+    if constexpr (std::is_same<decltype(f(k, v)), bool>::value) {
+      return f(k, v);
+    } else {
+      f(k, v);
+      return true;
+    }
+  });
+}
 
-  auto target_EH = (ExtendibleHash*)((uint64_t)EH[x] & ADDR_MASK);
-  auto global_depth = (uint64_t)EH[x] >> ADDR_BITS;
-  return target_EH->Find(key, global_depth);
+// outliers below the window, the window and outliers above it, in order
+template <typename K, typename V, size_t kNumSlot>
+inline size_t DyTIS<K, V, kNumSlot>::ParallelScanRange(Key_t lo, Key_t hi,
+    std::vector<Pair>& out, unsigned threads) {
+#ifdef CONCURRENT
+  epoch::EpochGuard guard;
+#endif
+  size_t base = out.size();
+  if (lo >= hi)
+    return 0;
+  DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+  Key_t last = window_base | ~window_mask;
+  if (lo < window_base && index != NULL)
+    index->ParallelScanRange(lo, std::min(hi, window_base), out, threads);
+  if (hi > window_base && lo <= last)
+    parallel_scan(to_internal(std::max(lo, window_base)),
+                  (hi > last) ? INVALID : to_internal(hi), out, threads);
+  if (last != INVALID && hi > last + 1 && index != NULL)
+    index->ParallelScanRange(std::max(lo, (Key_t)(last + 1)), hi, out, threads);
+  return out.size() - base;
+}
+
+// the spanned EHs are cut into one contiguous group per worker with about
+// the same number of keys (num_key of their segments). each worker scans its
+// group into its own buffer, then the buffers are copied to out in order.
+// lo and hi are shifted into the window.
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::parallel_scan(Key_t lo, Key_t hi,
+    std::vector<Pair>& out, unsigned threads) {
+  size_t base = out.size();
+  if (lo >= hi)
+    return;
+  const int shift = kKeyBits - kDepth;
+  std::vector<std::pair<size_t, uint64_t>> parts; // x, keys in EH[x]
+  uint64_t total = 0;
+  for (size_t x = next_used(lo >> shift); x <= ((hi - 1) >> shift);
+       x = next_used(x + 1)) {
+    uint64_t hidden = hidden_EH(x);
+    if (hidden == 0)
+      continue;
+    uint64_t num_key = 0;
+    for_each_segment((ExtendibleHash_t*)(hidden & ADDR_MASK), hidden >> ADDR_BITS,
+                     [&](Directory_t* seg, uint64_t) { num_key += seg->num_key; });
+    parts.emplace_back(x, num_key);
+    total += num_key;
+  }
+  threads = std::min<size_t>(std::max(threads, 1u), parts.size());
+  if (threads <= 1 || total < kParallelScanMin) {
+    scan_internal(lo, hi, [&](Key_t k, Value_t v) {
+      out.push_back(Pair{k, v});
+      return true;
+    });
+    return;
+  }
+
+  // [start[t], start[t+1]) is the key range of worker t
+  std::vector<Key_t> start(1, lo);
+  uint64_t sum = 0;
+  for (size_t i = 0; i + 1 < parts.size() && start.size() < threads; i++) {
+    sum += parts[i].second;
+    if (sum >= total * start.size() / threads)
+      start.push_back((Key_t)parts[i + 1].first << shift);
+  }
+  start.push_back(hi);
+  threads = start.size() - 1;
 
+  std::vector<std::vector<Pair>> buffer(threads);
+  run_threads(threads, [&](unsigned t) {
+    buffer[t].reserve(total / threads);
+    scan_internal(start[t], start[t + 1], [&](Key_t k, Value_t v) {
+      buffer[t].push_back(Pair{k, v});
+      return true;
+    });
+  });
+  std::vector<size_t> offset(threads + 1, base);
+  for (unsigned t = 0; t < threads; t++)
+    offset[t + 1] = offset[t] + buffer[t].size();
+  out.resize(offset[threads]);
+  run_threads(threads, [&](unsigned t) {
+    std::copy(buffer[t].begin(), buffer[t].end(), out.begin() + offset[t]);
+  });
 }
 
+template <typename K, typename V, size_t kNumSlot>
+inline V* DyTIS<K, V, kNumSlot>::Find(Key_t& key) {
 
-inline bool DyTIS::Update(Key_t& key, Value_t value) {
-  Value_t* val = Find(key);
-  if (val) {
-    *val = value;
-    return true;
+  if (!in_window(key)) {
+    DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+    return index == NULL ? NULL : index->Find(key);
+  }
+  Key_t internal = to_internal(key);
+  auto x = (internal >> (kKeyBits - kDepth));
+  uint64_t hidden = hidden_EH(x);
+  if (hidden == 0) return NULL;
+
+  auto target_EH = (ExtendibleHash_t*)(hidden & ADDR_MASK);
+  auto global_depth = hidden >> ADDR_BITS;
+  return target_EH->Find(internal, global_depth);
+
+}
+
+
+template <typename K, typename V, size_t kNumSlot>
+inline bool DyTIS<K, V, kNumSlot>::update(Key_t& key, Value_t value) {
+#ifdef CONCURRENT
+  epoch::EpochGuard guard;
+#endif
+  if (!in_window(key)) {
+    DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+    return index != NULL && index->update(key, value);
+  }
+  Key_t internal = to_internal(key);
+  auto x = (internal >> (kKeyBits - kDepth));
+RETRY:
+  uint64_t hidden = hidden_EH(x);
+  if (hidden == 0) return false;
+
+  auto target_EH = (ExtendibleHash_t*)(hidden & ADDR_MASK);
+  auto global_depth = hidden >> ADDR_BITS;
+  int ret = target_EH->Update(internal, value, global_depth);
+  if (ret == -1)
+    goto RETRY;
+  return ret;
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline size_t DyTIS<K, V, kNumSlot>::ReleaseMemory(void) {
+  size_t released = ctx.release_memory();
+  DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+  if (index != NULL)
+    released += index->ReleaseMemory();
+  return released;
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::GetPoolUsage(std::vector<PoolUsage>& usage) {
+  usage.clear();
+  ctx.pool_usage(usage);
+  for (DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+       index != NULL;
+       index = __atomic_load_n(&index->outliers, __ATOMIC_ACQUIRE))
+    index->ctx.pool_usage(usage);
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::memory_usage(IndexMemory& usage) {
+  usage.top_level += sizeof(DyTIS) + sizeof(ExtendibleHash_t*) * kCapacity
+                     + sizeof(uint64_t) * ((kCapacity + 63) / 64);
+  for (size_t x = next_used(0); x < kCapacity; x = next_used(x + 1)) {
+    uint64_t hidden = hidden_EH(x);
+    if (hidden == 0)
+      continue;
+    auto target_EH = (ExtendibleHash_t*)(hidden & ADDR_MASK);
+    auto global_depth = hidden >> ADDR_BITS;
+    usage.directories += target_EH->data_size(global_depth);
+    for_each_segment(target_EH, global_depth, [&](Directory_t* seg, uint64_t) {
+      size_t used_bytes = seg->num_key * Directory_t::kSlotBytes;
+      size_t cdf_bytes = (seg->line == NULL) ? 0
+                         : sizeof(LineFriends) << seg->range_bits;
+      usage.segments += seg->data_size() - Directory_t::chunk_size(seg->seg_num)
+                        - cdf_bytes;
+      usage.used_slots += used_bytes;
+      usage.empty_slots += Directory_t::chunk_size(seg->seg_num) - used_bytes;
+      usage.cdf_models += cdf_bytes;
+    });
+  }
+}
+
+// add target_EH and its segments to stats
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::shape_stats(ExtendibleHash_t* target_EH,
+    uint64_t global_depth, ShapeStats& stats) {
+  ShapeStats::count(stats.global_depth, global_depth);
+  for_each_segment(target_EH, global_depth, [&](Directory_t* seg, uint64_t ld) {
+    ShapeStats::count(stats.local_depth, ld);
+    ShapeStats::count(stats.seg_num, seg->seg_num);
+    ShapeStats::count(stats.util, (size_t)(seg->get_segment_util() * 10));
+    stats.segments++;
+    stats.keys += seg->num_key;
+    stats.slots += seg->seg_num * kNumSlot;
+    if (seg->line != NULL) {
+      stats.lines++;
+      ShapeStats::count(stats.range_bits, seg->range_bits);
+    }
+    else if (seg->seg_num > 1)
+      stats.expanded++;
+    if (seg->remap_available > 0)
+      stats.remap_ready++;
+    else if (seg->remap_available == 0)
+      stats.remap_exhausted++;
+    else
+      stats.remap_failed++;
+    if (seg->reclaim_flag > 0)
+      stats.reclaimed++;
+  });
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline IndexStats DyTIS<K, V, kNumSlot>::Stats(void) {
+  IndexStats stats;
+  stats.EH.resize(kCapacity);
+  for (size_t x = next_used(0); x < kCapacity; x = next_used(x + 1)) {
+    uint64_t hidden = hidden_EH(x);
+    if (hidden == 0)
+      continue;
+    shape_stats((ExtendibleHash_t*)(hidden & ADDR_MASK), hidden >> ADDR_BITS,
+                stats.EH[x]);
+    stats.EH[x].uniform = (ctx.bits_of(x) == UNIFORM_MAX_BITS);
+    stats.total.add(stats.EH[x]);
+  }
+  stats.reclaims = __atomic_load_n(&ctx.reclaims, __ATOMIC_RELAXED);
+  stats.max_bits = ctx.max_bits;
+  for (DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+       index != NULL;
+       index = __atomic_load_n(&index->outliers, __ATOMIC_ACQUIRE)) {
+    for (size_t x = index->next_used(0); x < kCapacity; x = index->next_used(x + 1)) {
+      uint64_t hidden = index->hidden_EH(x);
+      if (hidden == 0)
+        continue;
+      index->shape_stats((ExtendibleHash_t*)(hidden & ADDR_MASK),
+                         hidden >> ADDR_BITS, stats.outliers);
+      stats.outliers.uniform += (index->ctx.bits_of(x) == UNIFORM_MAX_BITS);
+    }
+    stats.reclaims += __atomic_load_n(&index->ctx.reclaims, __ATOMIC_RELAXED);
+  }
+  stats.total.add(stats.outliers);
+  return stats;
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline IndexMemory DyTIS<K, V, kNumSlot>::MemoryUsage(void) {
+  IndexMemory usage;
+  memory_usage(usage);
+  for (DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+       index != NULL;
+       index = __atomic_load_n(&index->outliers, __ATOMIC_ACQUIRE))
+    index->memory_usage(usage);
+  std::vector<PoolUsage> pools;
+  GetPoolUsage(pools);
+  for (auto& pool : pools)
+    usage.pool_cached += pool.cached_bytes;
+  return usage;
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline SMOStats DyTIS<K, V, kNumSlot>::GetSMOStats(void) {
+  SMOStats stats;
+  ctx.smo_stats(stats);
+  for (DyTIS* index = __atomic_load_n(&outliers, __ATOMIC_ACQUIRE);
+       index != NULL;
+       index = __atomic_load_n(&index->outliers, __ATOMIC_ACQUIRE))
+    index->ctx.smo_stats(stats);
+  return stats;
+}
+
+#ifdef CONCURRENT
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::StartMaintenance(void) {
+  if (maintainer != NULL)
+    return;
+  ctx.deferred = new MPSCQueue<std::pair<Key_t, Key_t>>(kMaintenanceQueue);
+  maintaining.store(true, std::memory_order_release);
+  maintainer = new std::thread([this] { maintain(); });
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::StopMaintenance(void) {
+  if (maintainer == NULL)
+    return;
+  maintaining.store(false, std::memory_order_release);
+  maintainer->join();
+  delete maintainer;
+  maintainer = NULL;
+  delete ctx.deferred;
+  ctx.deferred = NULL;
+}
+
+// every segment with parked pairs is queued once they become non-empty and
+// stays covered by the queued range until drained, splits only narrow it
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::maintain(void) {
+  std::pair<Key_t, Key_t> range;
+  int idle = 0;
+  while (true) {
+    if (ctx.deferred->pop(range)) {
+      drain_overflow(range.first, range.second);
+      idle = 0;
+      continue;
+    }
+    if (!maintaining.load(std::memory_order_acquire))
+      break;
+    // spin briefly, then stop burning the core while nothing is parked
+    if (++idle < 1024)
+      cpu_relax();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+  }
+}
+
+// move the parked pairs of every segment in [key, last] (internal keys) into
+// the slots
+template <typename K, typename V, size_t kNumSlot>
+inline void DyTIS<K, V, kNumSlot>::drain_overflow(Key_t key, Key_t last) {
+  epoch::EpochGuard guard;
+  const int shift = kKeyBits - kDepth;
+  while (true) {
+    size_t x = (key >> shift);
+    uint64_t hidden = hidden_EH(x);
+    if (hidden == 0) {
+      key = (Key_t)((Key_t)x << shift | y_mask);
+    } else {
+      auto target_EH = (ExtendibleHash_t*)(hidden & ADDR_MASK);
+      if (target_EH->Drain(key, hidden >> ADDR_BITS, &EH[x], ctx) == -1)
+        continue; // EH[x] was doubled
+    }
+    if (key >= last)
+      return;
+    key++;
   }
-  return false;
 }
+#endif
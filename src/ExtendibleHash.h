@@ -16,10 +16,26 @@ limitations under the License.
 
 #pragma once
 
-typedef struct ExtendibleHash ExtendibleHash;
-
+template <typename K, typename V, size_t kNumSlot>
 struct ExtendibleHash {
-  Directory** seg;
+  typedef Directory<K, V, kNumSlot> Directory_t;
+  typedef IndexContext<K, V, kNumSlot> Context;
+  typedef K Key_t;
+  typedef V Value_t;
+  typedef KVPair<K, V> Pair;
+  static constexpr uint16_t block = Directory_t::block;
+  static constexpr int kKeyBits = Directory_t::kKeyBits;
+  static constexpr uint64_t y_mask = Directory_t::y_mask;
+  static_assert(sizeof(Directory_t) == (1 << DIRECTORY_BITS),
+                "local depth is hidden in Directory* by pointer arithmetic");
+
+  Directory_t** seg;
+#ifdef CONCURRENT
+  // serializes directory updates (split, doubling) of writers.
+  // seg and the global depth never change once published; doubling installs
+  // a new ExtendibleHash and marks this one obsolete.
+  VersionLock lock;
+#endif
 
   ExtendibleHash(void) {
     seg = NULL;
@@ -27,22 +43,48 @@ struct ExtendibleHash {
 
   ExtendibleHash(short GD) {
     uint64_t capacity = (pow(2, GD));
-    seg = new Directory*[capacity];
+    seg = new Directory_t*[capacity];
   }
 
   ~ExtendibleHash(void) {
     delete [] seg;
   }
 
-  size_t data_size(void) {
+  // seg[y], with concurrent writers the segment it points to is complete
+  uint64_t load_seg(size_t y) {
+#ifdef CONCURRENT
+    return (uint64_t)__atomic_load_n(&seg[y], __ATOMIC_ACQUIRE);
+#else
+    return (uint64_t)seg[y];
+#endif
+  }
+
+  // publish a split segment (hidden local depth included) at seg[y]
+  void store_seg(size_t y, Directory_t* entry) {
+#ifdef CONCURRENT
+    __atomic_store_n(&seg[y], entry, __ATOMIC_RELEASE);
+#else
+    seg[y] = entry;
+#endif
+  }
+
+  // with the segment array of global depth GD, segments not included
+  size_t data_size(short GD) {
     size_t size = sizeof(ExtendibleHash);
+    size += sizeof(Directory_t*) << GD;
     return size;
   }
 
-  inline int Insert(Key_t&, Value_t, short);
-  inline bool Delete(Key_t&, short);
+  // writers return -1 when the caller has to reload EH[x] and retry
+  inline int Insert(Key_t&, Value_t, short, ExtendibleHash**, Context&,
+                    bool drain = false);
+#ifdef CONCURRENT
+  inline int Drain(Key_t&, short, ExtendibleHash**, Context&);
+#endif
+  inline int Delete(Key_t&, short);
+  inline int Update(Key_t&, Value_t, short);
   inline Value_t Get(Key_t&, short);
-  inline void Scan(Key_t&, int&, size_t, Value_t*, short);
+  template <typename F> inline int Scan(Key_t&, Key_t, short, F&&);
   inline Value_t* Find(Key_t&, short);
 
 };
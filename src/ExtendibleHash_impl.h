@@ -16,83 +16,156 @@ limitations under the License.
 
 #pragma once
 #include "src/ExtendibleHash.h"
-inline int ExtendibleHash::Insert(Key_t& key, Value_t value, short global_depth) {
+// with drain (CONCURRENT only), move the parked pair of key into the slots
+// instead (value is ignored), restructuring the segment until it fits
+template <typename K, typename V, size_t kNumSlot>
+inline int ExtendibleHash<K, V, kNumSlot>::Insert(Key_t& key, Value_t value,
+    short global_depth, ExtendibleHash** hidden, Context& ctx,
+    [[maybe_unused]] bool drain) {
 
 RETRY:
   size_t key_hash = key & y_mask;
   size_t y;
   if (global_depth == 0) y = 0;
-  else y = (key_hash >> (8*sizeof(key_hash) -kDepth- global_depth));
+  else y = (key_hash >> (kKeyBits -kDepth- global_depth));
 
-  uint64_t local_depth = (uint64_t)seg[y] >> (64 - LOCAL_DEPTH_BITS);
-  auto target = (Directory*)((uint64_t)seg[y] & ADDR_MASK);
+  uint64_t entry = load_seg(y);
+  uint64_t local_depth = entry >> (64 - LOCAL_DEPTH_BITS);
+  auto target = (Directory_t*)(entry & ADDR_MASK);
+#ifdef CONCURRENT
+  if (!target->lock.write_lock())
+    return -1; // target was split
+#endif
 
   size_t local_mask;
   if (local_depth == 0)
     local_mask = 0;
   else
-    local_mask = ((size_t)1 << (8*sizeof(Key_t)-kDepth-local_depth))-1;
+    local_mask = ((size_t)1 << (kKeyBits-kDepth-local_depth))-1;
   size_t masked_key_hash = key_hash & local_mask;
   size_t local_key_hash = target->lcdf(local_depth, masked_key_hash);
-  auto z = (local_key_hash >> (64 - kDepth - local_depth));
+  auto z = (local_key_hash >> (kKeyBits - kDepth - local_depth));
+#ifdef CONCURRENT
+  target->lock.begin_write();
+  int parked = target->overflow_find(key);
+  if (parked != -1 && !drain)
+    target->overflow->pairs[parked].value = value;
+  // updated where it is parked, or deleted / moved in by another drain
+  if ((parked != -1) != drain) {
+    target->lock.end_write();
+    target->lock.write_unlock();
+    return global_depth;
+  }
+  if (drain)
+    value = target->overflow->pairs[parked].value;
+#endif
   auto ret = target->Insert(key, value, key_hash, z);
+#ifdef CONCURRENT
+  bool first_parked = false;
+  if (ret != -1 && drain) {
+    target->overflow_erase(parked);
+  } else if (ret == -1 && !drain && ctx.deferred != NULL
+             && target->overflow_insert(key, value)) {
+    // the maintenance thread restructures the segment, not this writer
+    first_parked = (target->overflow->num == 1);
+    ret = 0;
+  }
+  target->lock.end_write();
+  if (first_parked) {
+    target->lock.write_unlock();
+    size_t seg_mask = ((size_t)1 << (kKeyBits-kDepth-local_depth))-1;
+    ctx.deferred->push({(Key_t)(key & ~seg_mask), (Key_t)(key | seg_mask)});
+    return global_depth;
+  }
+#endif
 
   if (ret == -1) {
+#ifdef CONCURRENT
+    // local cdf and slots may change in place until we decide to split
+    target->lock.begin_write();
+#endif
+#ifdef INSERT_BUFFER
+    target->flush_buffers();
+#endif
+    // read once, sample_full of another writer may change it
+    size_t x = key >> (kKeyBits - kDepth);
+    int max_bits = ctx.bits_of(x);
+    if (local_depth >= REMAP_THRE)
+      ctx.sample_full(x, target->get_segment_util() >= BUC_THRE);
     // when LD < GD
     if (local_depth < global_depth && local_depth >= REMAP_THRE) {
-      int PRACTICAL_MAX_SEG_NUM = max_bucket_num(local_depth);
+      int PRACTICAL_MAX_SEG_NUM = target->max_seg_num(local_depth, max_bits);
       double seg_util = target->get_segment_util();
       if (seg_util < BUC_THRE) {
         if (target->line == NULL)
-          target->init_lcdf(local_depth);
+          target->init_lcdf(local_depth, ctx);
         if (target->remap_available > 0 && target->seg_num <= PRACTICAL_MAX_SEG_NUM) { // skewed in target segment
-          target->divide_ranges_if_needed(masked_key_hash, local_depth);
-          target->LocalRemap(masked_key_hash, local_depth);
+          uint64_t smo_start = Context::smo_clock();
+          target->divide_ranges_if_needed(masked_key_hash, local_depth, ctx);
+          ctx.count_smo(ctx.smo.divide, smo_start);
+          smo_start = Context::smo_clock();
+          target->LocalRemap(masked_key_hash, local_depth, max_bits, ctx);
 
           if (target->remap_available != -1) {
-            goto RETRY;
+            ctx.count_smo(ctx.smo.remap, smo_start);
+            goto RESTRUCTURED;
           }
+          ctx.count_smo(ctx.smo.remap_failed, smo_start);
 
         }
       }
     }
     if (local_depth >= global_depth && global_depth >= REMAP_THRE) {
-      int PRACTICAL_MAX_SEG_NUM = max_bucket_num(local_depth);
-
       double seg_util = target->get_segment_util();
       if (seg_util >= BUC_THRE) { // uniformly distributed in target segment
-        bool expansion = target->Expand(local_depth, target->range_bits);
+        uint64_t smo_start = Context::smo_clock();
+        bool expansion = target->Expand(local_depth, target->range_bits, max_bits, ctx);
+        ctx.count_smo(expansion ? ctx.smo.expand : ctx.smo.expand_failed, smo_start);
         if (expansion) { // expansion success
-          goto RETRY;
+          goto RESTRUCTURED;
         }
       } // high segment util condition done
       else  {// buc_util < BUC_THRE, meaning skewed in target segment and EH x
         if (target->line == NULL) {
-          target->init_lcdf(local_depth);
+          target->init_lcdf(local_depth, ctx);
         }
         if (target->remap_available > 0) {
-          target->divide_ranges_if_needed(masked_key_hash, local_depth);
-          target->LocalRemap(masked_key_hash, local_depth);
+          uint64_t smo_start = Context::smo_clock();
+          target->divide_ranges_if_needed(masked_key_hash, local_depth, ctx);
+          ctx.count_smo(ctx.smo.divide, smo_start);
+          smo_start = Context::smo_clock();
+          target->LocalRemap(masked_key_hash, local_depth, max_bits, ctx);
           if (target->remap_available != -1) {
-            goto RETRY;
+            ctx.count_smo(ctx.smo.remap, smo_start);
+            goto RESTRUCTURED;
           }
+          ctx.count_smo(ctx.smo.remap_failed, smo_start);
         }
       }
     }
+#ifdef CONCURRENT
+    target->lock.end_write();
+    // split does not modify target, so readers can keep using it
+    if (!lock.write_lock()) { // directory was doubled by another writer
+      target->lock.write_unlock();
+      return -1;
+    }
+#endif
 
 
-    Directory** s = target->Split(z, local_depth);
+    uint64_t smo_start = Context::smo_clock();
+    Directory_t** s = target->Split(z, local_depth, ctx);
     s[1]->sibling = target->sibling;
     s[0]->sibling = s[1];
     int chunk_size = pow(2, global_depth - local_depth);
     int prev_y = y - (y % chunk_size) - 1;
     if (prev_y >= 0) {
-      auto prev_seg = (Directory*)((uint64_t)seg[prev_y] & ADDR_MASK);
-      prev_seg->sibling = s[0];
+      auto prev_seg = (Directory_t*)(load_seg(prev_y) & ADDR_MASK);
+      // scans may follow it before the directory is updated
+      __atomic_store_n(&prev_seg->sibling, s[0], __ATOMIC_RELEASE);
     }
 
     local_depth++;
-    int PRACTICAL_MAX_SEG_NUM = max_bucket_num(local_depth);
 
     { // CRITICAL SECTION - directory update
       if (local_depth-1 < global_depth) {  // normal split
@@ -100,27 +173,28 @@ RETRY:
         uint64_t hidden_ld = local_depth << LOCAL_DEPTH_SHIFT;
         if (depth_diff == 0) {
           if (y%2 == 0) {
-            seg[y+1] = hidden_ld + s[1];
-            seg[y] = hidden_ld + s[0];
+            store_seg(y+1, hidden_ld + s[1]);
+            store_seg(y, hidden_ld + s[0]);
           } else {
-            seg[y] = hidden_ld + s[1];
-            seg[y-1] = hidden_ld + s[0];
+            store_seg(y, hidden_ld + s[1]);
+            store_seg(y-1, hidden_ld + s[0]);
           }
         } else {
           int chunk_size = pow(2, global_depth - (local_depth - 1));
           y = y - (y % chunk_size);
           for (unsigned i = 0; i < chunk_size/2; ++i) {
-            seg[y+chunk_size/2+i] = hidden_ld + s[1];
+            store_seg(y+chunk_size/2+i, hidden_ld + s[1]);
           }
           for (unsigned i = 0; i < chunk_size/2; ++i) {
-            seg[y+i] = hidden_ld + s[0];
+            store_seg(y+i, hidden_ld + s[0]);
           }
         }
+        ctx.count_smo(ctx.smo.split, smo_start);
       } else {  // directory doubling
 
         auto d = seg;
         uint64_t capacity = (pow(2, global_depth));
-        Directory** _seg = new Directory*[capacity*2];
+        Directory_t** _seg = new Directory_t*[capacity*2];
 
         for (unsigned i = 0; i < capacity; ++i) {
           if (i == y) {
@@ -132,85 +206,304 @@ RETRY:
             _seg[2*i+1] = d[i];
           }
         }
+#ifdef CONCURRENT
+        // publish a new EH, readers always see seg and global depth together
+        ExtendibleHash* _EH = new ExtendibleHash();
+        _EH->seg = _seg;
+        uint64_t hidden_gd = (uint64_t)(global_depth+1) << ADDR_BITS;
+        __atomic_store_n(hidden, (ExtendibleHash*)((uint64_t)_EH + hidden_gd),
+                         __ATOMIC_RELEASE);
+        lock.mark_obsolete();
+        target->lock.mark_obsolete();
+        target->lock.write_unlock();
+        lock.write_unlock();
+        ctx.retire_segment(target);
+        epoch::retire(&ctx, this, [](void*, void* p, size_t) {
+          delete static_cast<ExtendibleHash*>(p);
+        }, 0);
+        delete[] s;
+        ctx.count_smo(ctx.smo.doubling, smo_start);
+        return -1;
+#else
         delete[] seg;
         // update EH metadata after doubling
         seg = _seg;
-        global_depth++;
+        *hidden = (ExtendibleHash*)((uint64_t)*hidden + ((uint64_t)1 << ADDR_BITS));
+        ctx.retire_segment(target);
+        delete[] s;
+        ctx.count_smo(ctx.smo.doubling, smo_start);
+        return -1; // the caller may choose the key window before the next one
+#endif
       }
-      seg_alloc.destroy(target);
+#ifdef CONCURRENT
+      // readers may still be in target, it stays intact but obsolete
+      target->lock.mark_obsolete();
+      target->lock.write_unlock();
+      lock.write_unlock();
+#endif
+      ctx.retire_segment(target);
       delete[] s;
      }  // End of critical section
     goto RETRY;
   }
+#ifdef CONCURRENT
+  target->lock.write_unlock();
+#endif
   return global_depth;
+
+RESTRUCTURED: // local remap or expansion succeeded
+#ifdef CONCURRENT
+  target->lock.end_write();
+  target->lock.write_unlock();
+#endif
+  goto RETRY;
 }
 
 
-inline bool ExtendibleHash::Delete(Key_t& key, short global_depth) {
+#ifdef CONCURRENT
+// move the parked pairs of the segment holding key into its slots, then
+// leave key at the last key of the segment. -1 as Insert
+template <typename K, typename V, size_t kNumSlot>
+inline int ExtendibleHash<K, V, kNumSlot>::Drain(Key_t& key, short global_depth,
+    ExtendibleHash** hidden, Context& ctx) {
+  while (true) {
+    size_t y = ((key & y_mask) >> (kKeyBits - kDepth - global_depth));
+    uint64_t entry = load_seg(y);
+    uint64_t local_depth = entry >> (64 - LOCAL_DEPTH_BITS);
+    auto target = (Directory_t*)(entry & ADDR_MASK);
+    if (!target->lock.write_lock())
+      return -1;
+    bool empty = (target->overflow == NULL || target->overflow->num == 0);
+    Key_t parked = empty ? 0 : target->overflow->pairs[0].key;
+    target->lock.write_unlock();
+    if (empty) {
+      key |= (Key_t)(((size_t)1 << (kKeyBits - kDepth - local_depth)) - 1);
+      return global_depth;
+    }
+    global_depth = Insert(parked, Value_t(), global_depth, hidden, ctx, true);
+    if (global_depth == -1)
+      return -1;
+  }
+}
+#endif
+
+template <typename K, typename V, size_t kNumSlot>
+inline int ExtendibleHash<K, V, kNumSlot>::Delete(Key_t& key, short global_depth) {
 RETRY_D:
   auto key_hash = key & y_mask;
 
-  size_t y = (key_hash >> (8*sizeof(key_hash) - kDepth - global_depth));
+  size_t y = (key_hash >> (kKeyBits - kDepth - global_depth));
 
-  auto target = (Directory*)((uint64_t)seg[y] & ADDR_MASK);
-  uint64_t local_depth = (uint64_t)seg[y] >> (64 - LOCAL_DEPTH_BITS);
-  size_t local_mask = ((size_t)1 << (8*sizeof(Key_t) - kDepth - local_depth)) - 1;
+  uint64_t entry = load_seg(y);
+  auto target = (Directory_t*)(entry & ADDR_MASK);
+  uint64_t local_depth = entry >> (64 - LOCAL_DEPTH_BITS);
+#ifdef CONCURRENT
+  if (!target->lock.write_lock())
+    return -1;
+  target->lock.begin_write();
+#endif
+  size_t local_mask = ((size_t)1 << (kKeyBits - kDepth - local_depth)) - 1;
   size_t local_key_hash = key_hash & local_mask;
   local_key_hash = target->lcdf(local_depth, local_key_hash);
 
-  auto z = (local_key_hash >> (64 - kDepth - local_depth \
+  auto z = (local_key_hash >> (kKeyBits - kDepth - local_depth \
                                ));
+#ifdef CONCURRENT
+  int parked = target->overflow_find(key);
+  if (parked != -1) { // not in the slots then
+    target->overflow_erase(parked);
+    target->lock.end_write();
+    target->lock.write_unlock();
+    return 1;
+  }
+  auto ret = target->Delete(key, key_hash, z, true, local_depth);
+  target->lock.end_write();
+  target->lock.write_unlock();
+#else
   auto ret = target->Delete(key, key_hash, z, false, local_depth);
+#endif
   if (ret == -1) {
     DO_NOTHING;
   } else if (ret == -2) {
     goto RETRY_D;
-  } else {
-    return true;
   }
+  return 1;
 }
 
-inline Value_t ExtendibleHash::Get(Key_t& key, short global_depth) {
+template <typename K, typename V, size_t kNumSlot>
+inline int ExtendibleHash<K, V, kNumSlot>::Update(Key_t& key, Value_t value, short global_depth) {
   auto key_hash = key & y_mask;
-  size_t y = (key_hash >> (8*sizeof(key_hash) - kDepth - global_depth));
-  auto target = (Directory*)((uint64_t)seg[y] & ADDR_MASK);
-  uint64_t local_depth = (uint64_t)seg[y] >> (64 - LOCAL_DEPTH_BITS);
-  size_t local_mask = ((size_t)1 << (8*sizeof(Key_t) - kDepth - local_depth)) - 1;
+  size_t y = (key_hash >> (kKeyBits - kDepth - global_depth));
+  uint64_t entry = load_seg(y);
+  auto target = (Directory_t*)(entry & ADDR_MASK);
+  uint64_t local_depth = entry >> (64 - LOCAL_DEPTH_BITS);
+#ifdef CONCURRENT
+  if (!target->lock.write_lock())
+    return -1;
+  target->lock.begin_write();
+#endif
+  size_t local_mask = ((size_t)1 << (kKeyBits - kDepth - local_depth)) - 1;
   size_t local_key_hash = key_hash & local_mask;
   local_key_hash = target->lcdf(local_depth, local_key_hash);
-  auto z = (local_key_hash >> (64 - kDepth - local_depth \
+  auto z = (local_key_hash >> (kKeyBits - kDepth - local_depth));
+  Value_t* val = target->Find(key, z);
+  if (val)
+    *val = value;
+#ifdef CONCURRENT
+  target->lock.end_write();
+  target->lock.write_unlock();
+#endif
+  return val != NULL;
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline V ExtendibleHash<K, V, kNumSlot>::Get(Key_t& key, short global_depth) {
+  auto key_hash = key & y_mask;
+  size_t y = (key_hash >> (kKeyBits - kDepth - global_depth));
+#ifdef CONCURRENT
+RETRY:
+  bool restart = false;
+#endif
+  uint64_t entry = load_seg(y);
+  auto target = (Directory_t*)(entry & ADDR_MASK);
+  uint64_t local_depth = entry >> (64 - LOCAL_DEPTH_BITS);
+#ifdef CONCURRENT
+  uint64_t version = target->lock.read_begin(restart);
+  if (restart)
+    goto RETRY;
+#endif
+  size_t local_mask = ((size_t)1 << (kKeyBits - kDepth - local_depth)) - 1;
+  size_t local_key_hash = key_hash & local_mask;
+  local_key_hash = target->lcdf(local_depth, local_key_hash);
+  auto z = (local_key_hash >> (kKeyBits - kDepth - local_depth \
                                ));
+#ifdef CONCURRENT
+  Value_t ret = target->Get(key, z);
+  if (!target->lock.validate(version))
+    goto RETRY;
+  return ret;
+#else
   return target->Get(key, z);
+#endif
 }
 
-inline void ExtendibleHash::Scan(Key_t& key, int& count, size_t n, Value_t* result, short global_depth) {
-  if (key != 0) {
-    auto key_hash = key & y_mask;
-    size_t y = (key_hash >> (8*sizeof(key_hash) - kDepth - global_depth));
-    auto target = (Directory*)((uint64_t)seg[y] & ADDR_MASK);
-    uint64_t local_depth = (uint64_t)seg[y] >> (64 - LOCAL_DEPTH_BITS);
-    size_t local_mask = ((size_t)1 << (8*sizeof(Key_t) - kDepth - local_depth)) - 1;
-    size_t local_key_hash = key_hash & local_mask;
-    local_key_hash = target->lcdf(local_depth, local_key_hash);
-    auto z = (local_key_hash >> (64 - kDepth - local_depth \
-                                 ));
-    target->Scan(key, count, n, z, result);
+// visit pairs with key in [key, end_key) in key order until f returns false.
+// return 0 if f or end_key stopped the scan, 1 at the end of this EH and -1 if a
+// concurrent writer changed a visited segment; then the caller resumes after
+// the last visited key.
+template <typename K, typename V, size_t kNumSlot>
+template <typename F>
+inline int ExtendibleHash<K, V, kNumSlot>::Scan(Key_t& key, Key_t end_key,
+    short global_depth, F&& f) {
+  auto key_hash = key & y_mask;
+  size_t y = (key_hash >> (kKeyBits - kDepth - global_depth));
+  uint64_t entry = load_seg(y);
+  auto target = (Directory_t*)(entry & ADDR_MASK);
+  uint64_t local_depth = entry >> (64 - LOCAL_DEPTH_BITS);
+#ifdef CONCURRENT
+  // a bucket worth of pairs is validated before f sees it
+  Key_t keys[block];
+  Value_t values[block];
+  bool restart = false;
+  uint64_t version = target->lock.read_begin(restart);
+  if (restart)
+    return -1;
+  size_t pos = target->scan_position(key, local_depth);
+  while (true) {
+    auto o = target->overflow;
+    if (o != NULL && o->num != 0) {
+      // parked pairs are merged in, the rest of the segment at once
+      std::vector<Pair> pairs;
+      bool bounded = false;
+      target->Scan(pos, [&](Key_t k, Value_t v) {
+        bounded = (k >= end_key);
+        if (!bounded)
+          pairs.push_back(Pair(k, v));
+        return !bounded;
+      });
+      size_t slotted = pairs.size();
+      uint32_t n = std::min<uint32_t>(o->num, OVERFLOW_SIZE);
+      for (uint32_t i = 0; i < n && o->pairs[i].key < end_key; i++) {
+        if (o->pairs[i].key >= key)
+          pairs.push_back(o->pairs[i]);
+      }
+      bounded = bounded || (n > 0 && o->pairs[n-1].key >= end_key);
+      Directory_t* next = __atomic_load_n(&target->sibling, __ATOMIC_ACQUIRE);
+      if (!target->lock.validate(version))
+        return -1;
+      std::inplace_merge(pairs.begin(), pairs.begin() + slotted, pairs.end(),
+          [](const Pair& a, const Pair& b) { return a.key < b.key; });
+      for (auto& p : pairs) {
+        if (!f(p.key, p.value))
+          return 0;
+      }
+      if (bounded)
+        return 0;
+      target = next;
+      if (target == NULL)
+        return 1;
+      version = target->lock.read_begin(restart);
+      if (restart)
+        return -1;
+      pos = 0;
+      continue;
+    }
+    int num = 0;
+    bool bounded = false;
+    bool end = target->Scan(pos, [&](Key_t k, Value_t v) {
+      if (k >= end_key) {
+        bounded = true;
+        return false;
+      }
+      keys[num] = k;
+      values[num++] = v;
+      return num < block;
+    });
+    Directory_t* next = __atomic_load_n(&target->sibling, __ATOMIC_ACQUIRE);
+    if (!target->lock.validate(version))
+      return -1;
+    for (int i = 0; i < num; i++) {
+      if (!f(keys[i], values[i]))
+        return 0;
+    }
+    if (bounded)
+      return 0;
+    if (!end) // buffer is full, continue in this segment
+      continue;
+    target = next;
+    if (target == NULL)
+      return 1;
+    version = target->lock.read_begin(restart);
+    if (restart)
+      return -1;
+    pos = 0;
   }
-  else { // Scan from first segment of the EH
-    auto target = (Directory*)((uint64_t)seg[0] & ADDR_MASK);
-    target->Scan(key, count, n, 0, result);
+#else
+  size_t pos = target->scan_position(key, local_depth);
+  auto visit = [&](Key_t k, Value_t v) {
+    return k < end_key && f(k, v);
+  };
+  while (target != NULL) {
+    if (!target->Scan(pos, visit))
+      return 0;
+    target = target->sibling;
+    pos = 0;
   }
+  return 1;
+#endif
 }
 
-inline Value_t* ExtendibleHash::Find(Key_t& key, short global_depth) {
+template <typename K, typename V, size_t kNumSlot>
+inline V* ExtendibleHash<K, V, kNumSlot>::Find(Key_t& key, short global_depth) {
   auto key_hash = key & y_mask;
-  size_t y = (key_hash >> (8*sizeof(key_hash) - kDepth - global_depth));
-  auto target = (Directory*)((uint64_t)seg[y] & ADDR_MASK);
-  uint64_t local_depth = (uint64_t)seg[y] >> (64 - LOCAL_DEPTH_BITS);
-  size_t local_mask = ((size_t)1 << (8*sizeof(Key_t) - kDepth - local_depth)) - 1;
+  size_t y = (key_hash >> (kKeyBits - kDepth - global_depth));
+  uint64_t entry = load_seg(y);
+  auto target = (Directory_t*)(entry & ADDR_MASK);
+  uint64_t local_depth = entry >> (64 - LOCAL_DEPTH_BITS);
+  size_t local_mask = ((size_t)1 << (kKeyBits - kDepth - local_depth)) - 1;
   size_t local_key_hash = key_hash & local_mask;
   local_key_hash = target->lcdf(local_depth, local_key_hash);
-  auto z = (local_key_hash >> (64 - kDepth - local_depth \
+  auto z = (local_key_hash >> (kKeyBits - kDepth - local_depth \
                                ));
   return target->Find(key, z);
 
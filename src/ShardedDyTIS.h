@@ -0,0 +1,92 @@
+/*
+Copyright 2023, The DyTIS Authors.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "util/mpsc.h"
+#include "src/DyTIS.h"
+
+const size_t kShardQueueSize = 4096; // requests in flight per worker
+
+// Multi-threaded write front-end of one DyTIS.
+// EH[x] is owned by worker x % threads (outliers of the key window by worker
+// kCapacity % threads), and every write is routed to the queue of the owner,
+// so workers never touch the same EH and writes of a key are applied in
+// submission order. Keys sharing their top kDepth bits below the window
+// prefix (e.g. a heavily skewed data set) end up on one worker. The window is
+// not chosen while a front-end is attached, so load the index first (the
+// outlier index, written by one worker, still chooses its own).
+//
+// Writes are asynchronous; Flush waits until every write submitted before it
+// is applied. Reads go to the index: alongside the workers in the concurrent
+// mode, only after Flush otherwise. Without -DCONCURRENT the index must not
+// be written directly while a front-end is attached.
+template <typename K = Key_t, typename V = Value_t,
+          size_t kNumSlot = kNumSlotDefault>
+class ShardedDyTIS {
+  public:
+    typedef DyTIS<K, V, kNumSlot> Index;
+    typedef K Key_t;
+    typedef V Value_t;
+
+  private:
+    enum Op : uint32_t { kInsert, kUpdate, kDelete };
+
+    struct Request {
+      Key_t key;
+      Value_t value;
+      uint32_t op;
+    };
+
+    struct alignas(64) Worker {
+      MPSCQueue<Request> queue{kShardQueueSize};
+      std::atomic<uint64_t> applied{0}; // requests taken from queue and done
+      std::thread thread;
+    };
+
+    Index& index;
+    const unsigned num_workers;
+    Worker* workers;
+    std::atomic<bool> stop{false};
+#ifndef CONCURRENT
+    // workers park here while one of them runs the deferred uniform_test
+    std::mutex pause_mutex;
+    std::condition_variable pause_cv;
+    unsigned parked = 0;
+#endif
+
+    inline void submit(uint32_t, Key_t, Value_t);
+    inline void run(Worker&);
+    inline void apply(Request&);
+#ifndef CONCURRENT
+    inline void pause(void);
+#endif
+
+  public:
+  ShardedDyTIS(Index&, unsigned);
+  ShardedDyTIS(const ShardedDyTIS&) = delete;
+  ShardedDyTIS& operator=(const ShardedDyTIS&) = delete;
+  // applies every pending write before the workers exit
+  ~ShardedDyTIS(void);
+  inline void Insert(Key_t, Value_t);
+  inline void Update(Key_t, Value_t);
+  inline void Delete(Key_t);
+  inline void Flush(void);
+};
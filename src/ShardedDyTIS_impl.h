@@ -0,0 +1,138 @@
+/*
+Copyright 2023, The DyTIS Authors.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <chrono>
+#include "src/ShardedDyTIS.h"
+#include "src/DyTIS_impl.h"
+
+
+template <typename K, typename V, size_t kNumSlot>
+ShardedDyTIS<K, V, kNumSlot>::ShardedDyTIS(Index& _index, unsigned threads)
+  : index(_index), num_workers(std::max(threads, 1u))
+{
+#ifndef CONCURRENT
+  index.ctx.parallel = true;
+#endif
+  workers = new Worker[num_workers];
+  for (unsigned t = 0; t < num_workers; t++)
+    workers[t].thread = std::thread([this, t] { run(workers[t]); });
+}
+
+template <typename K, typename V, size_t kNumSlot>
+ShardedDyTIS<K, V, kNumSlot>::~ShardedDyTIS(void)
+{
+  Flush();
+  stop.store(true, std::memory_order_release);
+  for (unsigned t = 0; t < num_workers; t++)
+    workers[t].thread.join();
+  delete[] workers;
+#ifndef CONCURRENT
+  index.ctx.parallel = false;
+#endif
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void ShardedDyTIS<K, V, kNumSlot>::submit(uint32_t op, Key_t key,
+                                                 Value_t value) {
+  size_t x = index.partition(key);
+  workers[x % num_workers].queue.push(Request{key, value, op});
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void ShardedDyTIS<K, V, kNumSlot>::Insert(Key_t key, Value_t value) {
+  submit(kInsert, key, value);
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void ShardedDyTIS<K, V, kNumSlot>::Update(Key_t key, Value_t value) {
+  submit(kUpdate, key, value);
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void ShardedDyTIS<K, V, kNumSlot>::Delete(Key_t key) {
+  submit(kDelete, key, Value_t());
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void ShardedDyTIS<K, V, kNumSlot>::Flush(void) {
+  for (unsigned t = 0; t < num_workers; t++) {
+    uint64_t target = workers[t].queue.pushed();
+    while (workers[t].applied.load(std::memory_order_acquire) < target)
+      std::this_thread::yield();
+  }
+}
+
+// through the public interface, so an open log records the write
+template <typename K, typename V, size_t kNumSlot>
+inline void ShardedDyTIS<K, V, kNumSlot>::apply(Request& r) {
+  if (r.op == kInsert)
+    index.Insert(r.key, r.value);
+  else if (r.op == kUpdate)
+    index.Update(r.key, r.value);
+  else
+    index.Delete(r.key);
+}
+
+template <typename K, typename V, size_t kNumSlot>
+inline void ShardedDyTIS<K, V, kNumSlot>::run(Worker& w) {
+  Request r;
+  int idle = 0;
+  while (true) {
+#ifndef CONCURRENT
+    if (__atomic_load_n(&index.uniform_pending, __ATOMIC_RELAXED))
+      pause();
+#endif
+    if (w.queue.pop(r)) {
+      apply(r);
+      w.applied.fetch_add(1, std::memory_order_release);
+      idle = 0;
+      continue;
+    }
+    if (stop.load(std::memory_order_acquire)) {
+#ifndef CONCURRENT
+      if (__atomic_load_n(&index.uniform_pending, __ATOMIC_RELAXED))
+        continue; // the others wait for this worker in pause
+#endif
+      break;
+    }
+    // spin briefly, then stop burning the core while the queue is empty
+    if (++idle < 1024)
+      cpu_relax();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+  }
+}
+
+#ifndef CONCURRENT
+// uniform_test reads every EH, so all workers wait between requests while
+// the last one to arrive runs it
+template <typename K, typename V, size_t kNumSlot>
+inline void ShardedDyTIS<K, V, kNumSlot>::pause(void) {
+  std::unique_lock<std::mutex> lock(pause_mutex);
+  if (!__atomic_load_n(&index.uniform_pending, __ATOMIC_RELAXED))
+    return;
+  if (++parked == num_workers) {
+    index.uniform_tested = true;
+    index.uniform_test();
+    index.uniform_pending = false;
+    parked = 0;
+    pause_cv.notify_all();
+  } else {
+    pause_cv.wait(lock, [this] { return !index.uniform_pending; });
+  }
+}
+#endif
@@ -0,0 +1,126 @@
+/*
+Copyright 2023, The DyTIS Authors.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// increasing keys move past the key window of the top level, which has to
+// follow them instead of piling them up in one deep outlier EH.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include "src/DyTIS.h"
+#include "src/DyTIS_impl.h"
+
+typedef DyTIS<uint64_t, uint64_t> Index;
+
+const int kMaxGlobalDepth = 16;
+const size_t kMaxBytesPerKey = 128;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+static void verify(Index* index, const std::vector<uint64_t>& keys) {
+  size_t missing = 0;
+  for (uint64_t key : keys)
+    missing += (index->Get(key) != key + 1);
+  CHECK(missing == 0);
+  size_t count = 0;
+  bool sorted = true;
+  uint64_t prev = 0;
+  index->ScanRange(0, INVALID, [&](uint64_t key, uint64_t) {
+    sorted = sorted && (count == 0 || key > prev);
+    prev = key;
+    count++;
+  });
+  CHECK(sorted);
+  CHECK(count == keys.size());
+}
+
+// with threads, the keys after the first tenth go in by ParallelInsert in
+// batches of a tenth
+static void run(const char* name, const std::vector<uint64_t>& keys,
+                unsigned threads = 0) {
+  Index* index = new Index();
+  size_t batch = (threads == 0) ? keys.size() : keys.size() / 10;
+  for (size_t i = 0; i < batch; i++) {
+    uint64_t key = keys[i];
+    index->Insert(key, key + 1);
+  }
+  std::vector<Index::Pair> pairs;
+  for (size_t i = batch; i < keys.size(); i += batch) {
+    pairs.clear();
+    for (size_t j = i; j < std::min(keys.size(), i + batch); j++)
+      pairs.push_back(Index::Pair(keys[j], keys[j] + 1));
+    index->ParallelInsert(pairs.data(), pairs.size(), threads);
+  }
+  verify(index, keys);
+
+  IndexStats stats = index->Stats();
+  int depth = (int)stats.total.global_depth.size() - 1;
+  size_t bytes = index->MemoryUsage().total();
+  CHECK(depth <= kMaxGlobalDepth);
+  CHECK(bytes <= (1 << 24) + keys.size() * kMaxBytesPerKey);
+  CHECK(stats.outliers.keys <= stats.total.keys / 4);
+
+  const char* path = "/tmp/dytis_window_test.snapshot";
+  CHECK(index->SaveSnapshot(path));
+  Index* loaded = new Index();
+  CHECK(loaded->LoadSnapshot(path));
+  verify(loaded, keys);
+  remove(path);
+
+  printf("%s: %zu keys, global depth %d, %zu bytes\n", name, keys.size(),
+         depth, bytes);
+  delete loaded;
+  delete index;
+}
+
+int main(void) {
+  std::vector<uint64_t> keys;
+  for (size_t n : {3000, 1000000}) {
+    keys.clear();
+    for (size_t i = 0; i < n; i++)
+      keys.push_back(1000 + 3 * i);
+    run("arithmetic", keys);
+  }
+
+  // timestamps
+  srand(1);
+  keys.clear();
+  uint64_t key = 1700000000000000000ULL;
+  for (size_t i = 0; i < 1000000; i++) {
+    key += rand() % 2000 + 1;
+    keys.push_back(key);
+  }
+  run("timestamps", keys);
+  run("timestamps, parallel", keys, 4);
+
+  // a second increasing range far above the first one
+  for (size_t i = 0; i < 200000; i++)
+    keys.push_back(0x7a00000000000000ULL + 7 * i);
+  run("two ranges", keys);
+
+  if (failures != 0)
+    printf("%d checks failed\n", failures);
+  return failures != 0;
+}
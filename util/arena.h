@@ -0,0 +1,308 @@
+/*
+Copyright 2023, The DyTIS Authors.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <vector>
+#include <sys/mman.h>
+#include "util/util.h"
+
+const size_t kHugePage = (size_t)2 << 20;
+const size_t kPage = 4096;
+
+// Block allocator of the slabs of SlabPool and of slot arrays too large to
+// pool. Blocks are ARENA_ALIGN aligned, so
+// pooled chunks whose size is a multiple of it are too. Blocks of kHugePage
+// or more are mapped on a huge page boundary and, with HUGE_PAGES, backed by
+// huge pages: every whole huge page of the block for 1 (transparent, the
+// kernel may still refuse), the block rounded up to huge pages for 2
+// (MAP_HUGETLB from the reserved pool, 1 if it is exhausted).
+struct ArenaAllocator {
+  typedef std::size_t size_type;
+
+  // bytes before the block, keeps the size of the mapping (0 if not mapped)
+  static const size_t kHeader = ARENA_ALIGN;
+
+  static char* malloc(const size_type bytes) {
+    size_t total = bytes + kHeader;
+    size_t mapped = 0;
+    char* base = NULL;
+    if (HUGE_PAGES > 0 && total >= kHugePage)
+      base = map(total, mapped);
+    if (base == NULL) {
+      void* p;
+      if (posix_memalign(&p, ARENA_ALIGN, total) != 0)
+        return NULL;
+      base = (char*)p;
+    }
+    memcpy(base, &mapped, sizeof(mapped));
+    return base + kHeader;
+  }
+
+  static void free(char* const block) {
+    char* base = block - kHeader;
+    size_t mapped;
+    memcpy(&mapped, base, sizeof(mapped));
+    if (mapped != 0)
+      munmap(base, mapped);
+    else
+      ::free(base);
+  }
+
+  private:
+  // total bytes starting on a huge page, NULL if mmap failed
+  static char* map(size_t total, size_t& mapped) {
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if HUGE_PAGES == 2
+    mapped = (total + kHugePage - 1) & ~(kHugePage - 1);
+    void* p = mmap(NULL, mapped, prot, flags | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+      return (char*)p;
+#endif
+    // over-map by a huge page and trim both ends to align the start
+    mapped = (total + kPage - 1) & ~(kPage - 1);
+    size_t len = mapped + kHugePage;
+    char* raw = (char*)mmap(NULL, len, prot, flags, -1, 0);
+    if (raw == (char*)MAP_FAILED) {
+      mapped = 0;
+      return NULL;
+    }
+    char* base = (char*)(((uintptr_t)raw + kHugePage - 1) & ~(kHugePage - 1));
+    if (base > raw)
+      munmap(raw, base - raw);
+    if (raw + len > base + mapped)
+      munmap(base + mapped, raw + len - (base + mapped));
+#ifdef MADV_HUGEPAGE
+    madvise(base, mapped, MADV_HUGEPAGE);
+#endif
+    return base;
+  }
+};
+
+// live and cached bytes of one size class
+struct PoolUsage {
+  size_t chunk_size;
+  size_t live_bytes;   // chunks handed out
+  size_t cached_bytes; // free chunks kept in slabs, fragmentation
+};
+
+// Pool of fixed size chunks carved from ArenaAllocator blocks (slabs).
+// slabs grow from kMinSlab bytes to a huge page, a chunk goes back to its
+// own slab, and malloc fills the slabs in use before empty ones, so slabs
+// left without live chunks can be returned to the os: on release(), or on
+// free once empty slabs exceed POOL_RELEASE_THRE of the pool. free chunks
+// are kept by index outside the slab, release() also drops the whole pages
+// they cover. not thread-safe.
+class SlabPool {
+  static constexpr size_t kMinSlab = (size_t)64 << 10;
+  static constexpr size_t kMaxSlab = kHugePage - ArenaAllocator::kHeader;
+
+  struct Slab {
+    char* base;
+    size_t num;     // chunks
+    size_t carved;  // chunks taken from the untouched tail so far
+    size_t used;
+    std::vector<uint32_t> dirty; // freed since the last release
+    std::vector<uint32_t> clean; // their pages released, reused last
+    Slab* prev;
+    Slab* next;
+    Slab** list;    // partial or empty, NULL if full
+  };
+
+  const size_t size;
+  size_t slab_chunks;
+  std::map<char*, Slab*> slabs; // by base, finds the slab of a chunk
+  Slab* partial = NULL; // with live and free chunks
+  Slab* empty = NULL;
+  size_t slab_bytes = 0;
+  size_t empty_bytes = 0;
+  size_t used = 0;
+
+  inline void link(Slab* s, Slab** list) {
+    s->list = list;
+    s->prev = NULL;
+    s->next = *list;
+    if (*list != NULL)
+      (*list)->prev = s;
+    *list = s;
+  }
+
+  inline void unlink(Slab* s) {
+    if (s->prev != NULL)
+      s->prev->next = s->next;
+    else
+      *s->list = s->next;
+    if (s->next != NULL)
+      s->next->prev = s->prev;
+    s->list = NULL;
+  }
+
+  inline Slab* grow(void) {
+    size_t num = slab_chunks;
+    size_t max_num = kMaxSlab / size > 0 ? kMaxSlab / size : 1;
+    // full size slabs fill their huge page, the tail past the last chunk
+    // stays unused
+    char* base = ArenaAllocator::malloc(num == max_num ? std::max(num * size, kMaxSlab)
+                                                       : num * size);
+    if (base == NULL)
+      return NULL;
+    slab_chunks = std::min(slab_chunks * 2, max_num);
+    Slab* s = new Slab{base, num, 0, 0, {}, {}, NULL, NULL, NULL};
+    slabs.emplace(base, s);
+    slab_bytes += num * size;
+    empty_bytes += num * size;
+    link(s, &empty);
+    return s;
+  }
+
+  inline void destroy(Slab* s) {
+    unlink(s);
+    slabs.erase(s->base);
+    slab_bytes -= s->num * size;
+    empty_bytes -= s->num * size;
+    ArenaAllocator::free(s->base);
+    delete s;
+  }
+
+  // return the empty slabs but the first keep to the os
+  inline size_t release_empty(size_t keep) {
+    size_t released = 0;
+    Slab* s = empty;
+    for (size_t i = 0; s != NULL && i < keep; i++)
+      s = s->next;
+    while (s != NULL) {
+      Slab* next = s->next;
+      released += s->num * size;
+      destroy(s);
+      s = next;
+    }
+    return released;
+  }
+
+  // drop the whole pages covered by runs of free chunks, count those
+  // touching a dirty chunk (the others were dropped before)
+  inline size_t release_pages(Slab* s) {
+    if (s->dirty.empty())
+      return 0;
+    std::vector<uint64_t> free; // index << 1 | dirty
+    free.reserve(s->dirty.size() + s->clean.size());
+    for (uint32_t i : s->dirty)
+      free.push_back((uint64_t)i << 1 | 1);
+    for (uint32_t i : s->clean)
+      free.push_back((uint64_t)i << 1);
+    std::sort(free.begin(), free.end());
+    size_t released = 0;
+    uintptr_t counted = 0; // end of the last counted page
+    for (size_t a = 0, b; a < free.size(); a = b) {
+      for (b = a + 1; b < free.size() && (free[b] >> 1) == (free[b-1] >> 1) + 1; b++);
+      uintptr_t lo = ((uintptr_t)s->base + (free[a] >> 1) * size + kPage - 1) & ~(kPage - 1);
+      uintptr_t hi = ((uintptr_t)s->base + ((free[b-1] >> 1) + 1) * size) & ~(kPage - 1);
+      if (hi <= lo)
+        continue;
+      madvise((void*)lo, hi - lo, MADV_DONTNEED);
+      for (size_t i = a; i < b; i++) {
+        if (!(free[i] & 1))
+          continue;
+        uintptr_t start = (uintptr_t)s->base + (free[i] >> 1) * size;
+        uintptr_t from = std::max(std::max(lo, start & ~(kPage - 1)), counted);
+        uintptr_t to = std::min(hi, (start + size + kPage - 1) & ~(kPage - 1));
+        if (to > from) {
+          released += to - from;
+          counted = to;
+        }
+      }
+    }
+    s->clean.insert(s->clean.end(), s->dirty.begin(), s->dirty.end());
+    s->dirty.clear();
+    s->dirty.shrink_to_fit();
+    return released;
+  }
+
+  public:
+  SlabPool(size_t chunk_size) : size(chunk_size) {
+    slab_chunks = kMinSlab / size > 0 ? kMinSlab / size : 1;
+  }
+  SlabPool(const SlabPool&) = delete;
+  SlabPool& operator=(const SlabPool&) = delete;
+  ~SlabPool(void) {
+    for (auto& it : slabs) {
+      ArenaAllocator::free(it.first);
+      delete it.second;
+    }
+  }
+
+  inline void* malloc(void) {
+    Slab* s = partial != NULL ? partial : empty;
+    if (s == NULL && (s = grow()) == NULL)
+      return NULL;
+    size_t i;
+    if (!s->dirty.empty()) {
+      i = s->dirty.back();
+      s->dirty.pop_back();
+    }
+    else if (!s->clean.empty()) {
+      i = s->clean.back();
+      s->clean.pop_back();
+    }
+    else
+      i = s->carved++;
+    if (s->used++ == 0) {
+      empty_bytes -= s->num * size;
+      unlink(s);
+      link(s, &partial);
+    }
+    if (s->used == s->num)
+      unlink(s);
+    used++;
+    return s->base + i * size;
+  }
+
+  inline void free(void* chunk) {
+    Slab* s = std::prev(slabs.upper_bound((char*)chunk))->second;
+    s->dirty.push_back(((char*)chunk - s->base) / size);
+    used--;
+    if (s->used-- == s->num)
+      link(s, &partial);
+    if (s->used == 0) {
+      unlink(s);
+      link(s, &empty);
+      empty_bytes += s->num * size;
+      // one empty slab stays to absorb a malloc right after
+      if (empty_bytes > POOL_RELEASE_THRE * slab_bytes && empty->next != NULL)
+        release_empty(1);
+    }
+  }
+
+  // return the empty slabs and the pages of free chunks to the os, return
+  // the bytes released
+  inline size_t release(void) {
+    size_t released = release_empty(0);
+    for (Slab* s = partial; s != NULL; s = s->next)
+      released += release_pages(s);
+    return released;
+  }
+
+  inline PoolUsage usage(void) const {
+    return PoolUsage{size, used * size, slab_bytes - used * size};
+  }
+};
@@ -0,0 +1,138 @@
+/*
+Copyright 2023, The DyTIS Authors.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "util/lock.h"
+
+// Epoch-based reclamation used by the concurrent mode (-DCONCURRENT).
+// Every DyTIS operation runs inside an EpochGuard, which publishes the global
+// epoch in a per-thread slot. Memory unlinked by a writer (old slot arrays,
+// local cdf, split segments, EH replaced by doubling) is retired with the
+// current epoch and reclaimed once every active thread entered after it.
+namespace epoch {
+
+static const int kMaxThreads = 256;
+static const uint64_t kIdle = UINT64_MAX;
+static const size_t kReclaimBatch = 64; // try to reclaim every N retires
+
+struct alignas(64) Slot {
+  std::atomic<uint64_t> epoch{kIdle};
+  std::atomic<bool> used{false};
+};
+
+struct Retired {
+  uint64_t epoch;
+  void* owner; // index context, passed back to reclaim
+  void* addr;
+  void (*reclaim)(void*, void*, size_t);
+  size_t arg;
+};
+
+inline std::atomic<uint64_t> global_epoch{0};
+inline Slot slots[kMaxThreads];
+inline std::mutex retired_mutex;
+inline std::vector<Retired> retired;
+inline size_t num_retired = 0;
+
+// per-thread slot, released when the thread exits
+struct ThreadSlot {
+  Slot* slot = NULL;
+  int depth = 0; // nested guards
+
+  Slot* get(void) {
+    for (int i = 0; slot == NULL; i = (i + 1) % kMaxThreads) {
+      bool expected = false;
+      if (!slots[i].used.load(std::memory_order_relaxed) &&
+          slots[i].used.compare_exchange_strong(expected, true))
+        slot = &slots[i];
+      else if (i == kMaxThreads - 1) // all slots taken, wait for an exit
+        cpu_relax();
+    }
+    return slot;
+  }
+
+  ~ThreadSlot(void) {
+    if (slot != NULL)
+      slot->used.store(false, std::memory_order_release);
+  }
+};
+inline thread_local ThreadSlot self;
+
+struct EpochGuard {
+  EpochGuard(void) {
+    if (self.depth++ > 0)
+      return;
+    Slot* s = self.get();
+    s->epoch.store(global_epoch.load(std::memory_order_acquire));
+    // the slot must be visible before this thread reads any shared pointer
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  ~EpochGuard(void) {
+    if (--self.depth > 0)
+      return;
+    self.slot->epoch.store(kIdle, std::memory_order_release);
+  }
+};
+
+// must hold retired_mutex
+inline void collect(void) {
+  uint64_t min_epoch = kIdle;
+  for (int i = 0; i < kMaxThreads; i++) {
+    uint64_t e = slots[i].epoch.load();
+    if (e < min_epoch)
+      min_epoch = e;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < retired.size(); i++) {
+    if (retired[i].epoch < min_epoch)
+      retired[i].reclaim(retired[i].owner, retired[i].addr, retired[i].arg);
+    else
+      retired[kept++] = retired[i];
+  }
+  retired.resize(kept);
+}
+
+// addr must be unreachable from the index already
+inline void retire(void* owner, void* addr,
+                   void (*reclaim)(void*, void*, size_t), size_t arg) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64_t e = global_epoch.fetch_add(1);
+  std::lock_guard<std::mutex> guard(retired_mutex);
+  retired.push_back({e, owner, addr, reclaim, arg});
+  if (++num_retired % kReclaimBatch == 0)
+    collect();
+}
+
+// reclaim everything owner retired so far, no operation on owner may be in
+// flight. other owners keep waiting for their readers.
+inline void drain(void* owner) {
+  std::lock_guard<std::mutex> guard(retired_mutex);
+  size_t kept = 0;
+  for (size_t i = 0; i < retired.size(); i++) {
+    if (retired[i].owner == owner)
+      retired[i].reclaim(retired[i].owner, retired[i].addr, retired[i].arg);
+    else
+      retired[kept++] = retired[i];
+  }
+  retired.resize(kept);
+}
+
+} // namespace epoch
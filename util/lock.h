@@ -0,0 +1,105 @@
+/*
+Copyright 2023, The DyTIS Authors.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#endif
+}
+
+// Optimistic version lock used by the concurrent mode (-DCONCURRENT).
+//   bit 0    : obsolete (node was replaced by split / doubling)
+//   bit 1    : locked (held by a writer)
+//   bit 2    : dirty (writer is modifying the node in place)
+//   bit 3 ~  : version
+// Readers never write the lock word. They take a snapshot, read the node and
+// validate the snapshot afterwards. Only in-place modification (dirty) bumps
+// the version, so a node which is locked but left untouched (e.g., the source
+// segment of a split) stays readable while the writer works on it.
+struct VersionLock {
+  static const uint64_t kObsolete = 0x1;
+  static const uint64_t kLocked = 0x2;
+  static const uint64_t kDirty = 0x4;
+  static const uint64_t kVersion = 0x8;
+
+  std::atomic<uint64_t> word{0};
+
+  // reader side
+  inline uint64_t read_begin(bool& restart) const {
+    uint64_t v = word.load(std::memory_order_acquire);
+    while (v & kDirty) {
+      if (v & kObsolete) { // being torn down, go back to the directory
+        restart = true;
+        return v;
+      }
+      cpu_relax();
+      v = word.load(std::memory_order_acquire);
+    }
+    return v;
+  }
+
+  inline bool validate(uint64_t v) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t mask = ~(kLocked | kObsolete);
+    return (word.load(std::memory_order_relaxed) & mask) == (v & mask);
+  }
+
+  inline bool is_obsolete(void) const {
+    return word.load(std::memory_order_acquire) & kObsolete;
+  }
+
+  // writer side
+  // return false if the node became obsolete, i.e., caller must restart
+  inline bool write_lock(void) {
+    uint64_t v = word.load(std::memory_order_acquire);
+    while (true) {
+      if (v & kObsolete)
+        return false;
+      if (v & kLocked) {
+        cpu_relax();
+        v = word.load(std::memory_order_acquire);
+        continue;
+      }
+      if (word.compare_exchange_weak(v, v | kLocked,
+                                     std::memory_order_acquire))
+        return true;
+    }
+  }
+
+  inline void write_unlock(void) {
+    word.fetch_and(~kLocked, std::memory_order_release);
+  }
+
+  // must hold the lock
+  inline void begin_write(void) {
+    word.fetch_or(kDirty, std::memory_order_acq_rel);
+  }
+
+  inline void end_write(void) {
+    word.fetch_add(kVersion - kDirty, std::memory_order_release);
+  }
+
+  inline void mark_obsolete(void) {
+    word.fetch_or(kObsolete, std::memory_order_release);
+  }
+};
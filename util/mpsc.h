@@ -0,0 +1,81 @@
+/*
+Copyright 2023, The DyTIS Authors.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include "util/lock.h"
+
+// Bounded queue with many producers and one consumer (ShardedDyTIS).
+// Producers claim a ticket on tail and publish the cell by its sequence
+// number, so the consumer sees items in ticket order without locking.
+// Capacity must be a power of two.
+template <typename T>
+class MPSCQueue {
+  struct Cell {
+    std::atomic<uint64_t> seq;
+    T item;
+  };
+
+  Cell* cells;
+  const uint64_t mask;
+  alignas(64) std::atomic<uint64_t> tail{0}; // next ticket of producers
+  alignas(64) uint64_t head = 0; // consumer only
+
+  public:
+  MPSCQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; i++)
+      cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+  MPSCQueue(const MPSCQueue&) = delete;
+  MPSCQueue& operator=(const MPSCQueue&) = delete;
+  ~MPSCQueue(void) {
+    delete[] cells;
+  }
+
+  // wait while full, return the ticket of item
+  inline uint64_t push(const T& item) {
+    uint64_t ticket = tail.fetch_add(1, std::memory_order_relaxed);
+    Cell& c = cells[ticket & mask];
+    // consumer has not freed the cell of ticket - capacity yet
+    for (int spin = 0; c.seq.load(std::memory_order_acquire) != ticket; spin++) {
+      if (spin < 1024)
+        cpu_relax();
+      else
+        std::this_thread::yield();
+    }
+    c.item = item;
+    c.seq.store(ticket + 1, std::memory_order_release);
+    return ticket;
+  }
+
+  inline bool pop(T& item) {
+    Cell& c = cells[head & mask];
+    if (c.seq.load(std::memory_order_acquire) != head + 1)
+      return false;
+    item = c.item;
+    c.seq.store(head + mask + 1, std::memory_order_release);
+    head++;
+    return true;
+  }
+
+  // tickets handed out so far
+  inline uint64_t pushed(void) const {
+    return tail.load(std::memory_order_acquire);
+  }
+};
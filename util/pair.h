@@ -2,7 +2,10 @@
 #define UTIL_PAIR_H_
 
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
 
+// default key/value of the index, see DyTIS<K, V, kNumSlot>
 typedef uint64_t Key_t;
 typedef uint64_t Value_t;
 
@@ -11,28 +14,42 @@ const Key_t INVALID = -1; // 11111...111
 
 const Value_t NONE = 0x0;
 
-struct Key {
-  Key_t item;
-  Key(void)
-    : item{INVALID} { }
+// slots of the separated layout (-DSEP)
+template <typename K>
+struct KeyItem {
+  K item;
+  KeyItem(void)
+    : item{static_cast<K>(-1)} { }
 };
-struct Value {
-  Value_t item;
-  Value(void)
-    : item{INVALID} { }
+// value of empty slots, all bits set like INVALID for any payload.
+// specialize it for a payload that needs another one
+template <typename V>
+struct value_traits {
+  static V invalid(void) {
+    V v;
+    memset(static_cast<void*>(&v), 0xff, sizeof(v));
+    return v;
+  }
+};
+template <typename V>
+struct ValueItem {
+  V item;
+  ValueItem(void)
+    : item{value_traits<V>::invalid()} { }
 };
 
-struct Pair {
-  Key_t key;
-  Value_t value;
+template <typename K, typename V>
+struct KVPair {
+  K key;
+  V value;
 
-  Pair(void)
-  : key{INVALID} { }
+  KVPair(void)
+  : key{static_cast<K>(-1)} { }
 
-  Pair(Key_t _key, Value_t _value)
+  KVPair(K _key, V _value)
   : key{_key}, value{_value} { }
 
-  Pair& operator = (const Pair& other) {
+  KVPair& operator = (const KVPair& other) {
     key = other.key;
     value = other.value;
     return *this;
@@ -53,4 +70,8 @@ struct Pair {
   }
 #endif
 };
+
+typedef KeyItem<Key_t> Key;
+typedef ValueItem<Value_t> Value;
+typedef KVPair<Key_t, Value_t> Pair;
 #endif  // UTIL_PAIR_H_
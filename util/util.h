@@ -5,28 +5,29 @@
 #define RECLAIM_THRE 0.6
 #define SKEWED_MAX_BITS 1
 #define UNIFORM_MAX_BITS 7
+#define SKEW_SAMPLE 64 // full segments of an EH between two decisions of its max bits
+#define UNIFORM_ENTER 0.9 // share of them filled to BUC_THRE that lets the EH expand to UNIFORM_MAX_BITS
+#define UNIFORM_EXIT 0.7 // share that sets it back to SKEWED_MAX_BITS
+#define BULK_LOAD_FILL 0.7 // bucket utilization right after bulk load
+#define BULK_LOAD_MAX_DEPTH 24 // deepest segment built by bulk load
+#define INSERT_BUFFER_SIZE 16 // unsorted keys per bucket before merge (-DINSERT_BUFFER)
+#define WINDOW_MIN_SHARED_BITS 12 // key bits below the top level index all keys share before it is windowed
+#define WINDOW_SLACK_BITS 2 // the top level window spans at least 2^this times the observed key range
+#define WINDOW_OUTLIER_SHIFT 2 // the window is chosen again once outliers exceed 2^-this of the keys in it
+#define ARENA_ALIGN 64 // alignment of segments, slot arrays and local cdf
+#define HUGE_PAGES 1 // blocks of 2 MB or more: 0 small pages, 1 transparent huge pages, 2 MAP_HUGETLB first
+#define POOL_RELEASE_THRE 0.25 // a pool returns its empty slabs once they exceed this share of its slabs
+#define OVERFLOW_SIZE 32 // pairs a full segment parks for the maintenance thread (-DCONCURRENT)
 
 #define ADDR_BITS 48
-#define DIRECTORY_BITS 6
+#ifdef CONCURRENT
+#define DIRECTORY_BITS 7 // log2(sizeof(Directory)), padded for the version lock
+#else
+#define DIRECTORY_BITS 6 // log2(sizeof(Directory))
+#endif
 #define LOCAL_DEPTH_BITS 5
-static const int LOCAL_DEPTH_SHIFT = (64 - DIRECTORY_BITS - LOCAL_DEPTH_BITS);
-static const uint64_t ADDR_MASK = ((uint64_t) 1 << ADDR_BITS) - 1;
-
-static size_t kDepth = 9;
-const size_t kBucSize = 128 * 16; // segment size, 512 = 16B * 32 pairs, 1024 = 64 pairs, 4096 = 256 pairs
-const size_t kNumSlot = kBucSize/sizeof(Pair); // # key value pair slot of blocks in segment
-const uint16_t block = kNumSlot;
-size_t y_mask = ((size_t)1 << (8*sizeof(Key_t) - kDepth)) - 1;
-static bool UNIFORM_TEST = false;
-static int DEFAULT_MAX_BITS = SKEWED_MAX_BITS;
-uint64_t max_bucket_num (size_t local_depth) {
-  // [TODO] : return 1, not 2..
-  if (local_depth >= REMAP_THRE)
-    // If workload is skewed, DEFAULT_MAX_BITS is SKEWED_MAX_BITS
-    // Else if workload is uniform, DEFAULT_MAX_BITS is UNIFORM_MAX_BITS
-    return ((uint64_t)1 << (DEFAULT_MAX_BITS+local_depth-REMAP_THRE));
-  else
-    return 1;
-
-}
+constexpr int LOCAL_DEPTH_SHIFT = (64 - DIRECTORY_BITS - LOCAL_DEPTH_BITS);
+constexpr uint64_t ADDR_MASK = ((uint64_t) 1 << ADDR_BITS) - 1;
 
+constexpr size_t kDepth = 9; // key bits indexing the top level
+constexpr size_t kNumSlotDefault = 128; // # key value pair slots of a bucket
@@ -0,0 +1,189 @@
+/*
+Copyright 2023, The DyTIS Authors.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Append-only log of DyTIS writes (DyTIS::OpenLog).
+// Records are fixed size and checksummed, so a torn tail left by a crash is
+// detected and cut off on replay. Appends go to an in-memory buffer; one
+// write + fdatasync (group commit) makes every buffered record durable. It is
+// issued by the appender that fills sync_ops records, or by a flusher thread
+// every sync_us microseconds, whichever comes first.
+template <typename K, typename V>
+struct WriteAheadLog {
+  enum Op : uint32_t { kInsert = 1, kUpdate = 2, kDelete = 3 };
+
+  struct Record {
+    uint32_t op;
+    uint32_t checksum; // FNV-1a of the record with checksum = 0
+    K key;
+    V value;
+  };
+
+  int fd = -1;
+  size_t sync_ops = 0;
+  uint64_t sync_us = 0;
+  std::mutex buffer_mutex; // guards buffer and pending
+  std::vector<Record> buffer;
+  size_t pending = 0;
+  std::mutex sync_mutex; // serializes write + fdatasync, keeps log order
+  std::vector<Record> writing;
+  std::atomic<bool> failed{false};
+  std::thread flusher;
+  std::mutex flusher_mutex;
+  std::condition_variable flusher_cv;
+  bool stop = false;
+
+  ~WriteAheadLog(void) {
+    close();
+  }
+
+  static uint32_t checksum(const Record& r) {
+    unsigned char p[sizeof(Record)];
+    memcpy(p, &r, sizeof(Record));
+    memset(p + offsetof(Record, checksum), 0, sizeof(r.checksum));
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(Record); i++)
+      h = (h ^ p[i]) * 16777619u;
+    return h;
+  }
+
+  // call replay(record) for every complete record of the log at path, drop a
+  // torn tail and start appending after the last good record
+  template <typename F>
+  bool open(const char* path, size_t _sync_ops, uint64_t _sync_us, F&& replay) {
+    if (fd >= 0)
+      return false;
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+      return false;
+    sync_ops = std::max<size_t>(_sync_ops, 1);
+    sync_us = _sync_us;
+
+    std::vector<Record> chunk(4096);
+    off_t good = 0;
+    while (true) {
+      ssize_t n = pread(fd, chunk.data(), chunk.size() * sizeof(Record), good);
+      if (n <= 0)
+        break;
+      size_t num = n / sizeof(Record);
+      size_t i = 0;
+      for (; i < num; i++) {
+        const Record& r = chunk[i];
+        if (r.op < kInsert || r.op > kDelete || r.checksum != checksum(r))
+          break;
+        replay(r);
+      }
+      good += i * sizeof(Record);
+      if (i < chunk.size())
+        break;
+    }
+    if (ftruncate(fd, good) != 0 || lseek(fd, good, SEEK_SET) != good) {
+      ::close(fd);
+      fd = -1;
+      return false;
+    }
+    buffer.reserve(std::min<size_t>(sync_ops, 4096));
+    if (sync_us > 0)
+      flusher = std::thread([this] { flush_periodically(); });
+    return true;
+  }
+
+  inline void append(Op op, const K& key, const V& value) {
+    Record r;
+    memset(&r, 0, sizeof(r)); // padding is part of the checksum
+    r.op = op;
+    r.key = key;
+    r.value = value;
+    r.checksum = checksum(r);
+    bool full;
+    {
+      std::lock_guard<std::mutex> guard(buffer_mutex);
+      buffer.push_back(r);
+      full = (++pending >= sync_ops);
+    }
+    if (full)
+      sync();
+  }
+
+  // make every record appended so far durable, false once a write failed
+  bool sync(void) {
+    std::lock_guard<std::mutex> sync_guard(sync_mutex);
+    {
+      std::lock_guard<std::mutex> guard(buffer_mutex);
+      if (pending == 0)
+        return !failed;
+      writing.swap(buffer);
+      pending = 0;
+    }
+    // appenders keep filling the other buffer meanwhile
+    const char* p = (const char*)writing.data();
+    size_t left = writing.size() * sizeof(Record);
+    while (left > 0) {
+      ssize_t n = write(fd, p, left);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        failed = true;
+        break;
+      }
+      p += n;
+      left -= n;
+    }
+    if (!failed && fdatasync(fd) != 0)
+      failed = true;
+    writing.clear();
+    return !failed;
+  }
+
+  void flush_periodically(void) {
+    std::unique_lock<std::mutex> lock(flusher_mutex);
+    while (!stop) {
+      flusher_cv.wait_for(lock, std::chrono::microseconds(sync_us));
+      if (!stop)
+        sync();
+    }
+  }
+
+  void close(void) {
+    if (fd < 0)
+      return;
+    if (flusher.joinable()) {
+      {
+        std::lock_guard<std::mutex> guard(flusher_mutex);
+        stop = true;
+      }
+      flusher_cv.notify_one();
+      flusher.join();
+    }
+    sync();
+    ::close(fd);
+    fd = -1;
+  }
+};